@@ -1,61 +1,109 @@
+#include <unordered_map>
+#include <unordered_set>
+#include <memory>
+#include <mutex>
+
 namespace fst {
 typedef VectorFst<LogArc> LogVectorFst;
 }
 
-/* Add arcs corresponding to `trie` between `start` and `end` nodes
- * For each trie leaf, add the corresponding weight in `model` */
+/* Where the weight of a grammar arc comes from: one (weight 0), the loop or
+ * stop probability of the prefix or suffix length model, or a morpheme
+ * probability. Grammars can be built with the index of the source of each
+ * weight in place of the weight itself, index 0 being ONE. */
+struct WeightSource {
+    enum Kind { ONE, LOOP, STOP, MORPHEME };
+    Kind kind;
+    Part part;
+    int id; // substring id of a MORPHEME
+};
+
+/* Weight of an arc from `source` with value `value`, or the index of the
+ * source (appended to `sources`) if `sources` is given */
+inline float SourceWeight(std::vector<WeightSource>* sources,
+        WeightSource source, float value) {
+    if(sources == nullptr) return value;
+    sources->push_back(source);
+    return sources->size() - 1;
+}
+
+/* Add arcs spelling every substring of word type `w` that `filter` allows
+ * as a `part` morpheme between `start` and `end` nodes, sharing common
+ * prefixes as a trie would: the state reached after reading a substring is
+ * identified by its id. Each arc completing a substring carries the
+ * corresponding weight in `model` */
 template <typename Arc>
-void BuildBanana(const Trie& trie, int start, int end,
-        fst::VectorFst<Arc> &grammar, const DirichletMultinomial& model) {
-    for(auto& child: trie.nodes) {
-        char c = child.first;
-        int label = child.second.label;
-        float w = -log(model.Prob(label));
-        grammar.AddArc(start, Arc((unsigned char) c, (unsigned char) c, w, end));
-        if(child.second.nodes.size() > 0) {
-            const int k = grammar.AddState();
-            grammar.AddArc(start, Arc((unsigned char) c, (unsigned char) c, 0, k));
-            BuildBanana(child.second, k, end, grammar, model);
+void BuildBanana(const SubstringTable& substrings,
+        unsigned w, int start, int end,
+        fst::VectorFst<Arc> &grammar, const DirichletMultinomial& model,
+        const MorphemeFilter& filter, Part part,
+        std::vector<WeightSource>* sources=nullptr) {
+    const double norm = sources ? 0 : model.LogNormalizer();
+    const unsigned L = substrings.Length(w);
+    const int* chars = substrings.Labels(w);
+    std::unordered_map<int, int> state; // substring id -> state after reading it
+    std::unordered_set<int> completed; // substring ids with an arc to `end`
+    for(unsigned i = 0; i < L; i++) {
+        int from = start;
+        // The whole word may be a stem beyond the stem length cap
+        const unsigned last = (part == STEM && i == 0) ? L : i + filter.MaxLength(part, L - i);
+        for(unsigned j = i+1; j <= last; j++) {
+            const int label = substrings.Id(w, i, j);
+            const int c = chars[j-1];
+            if(filter.Allows(part, L, i, j, label) && completed.insert(label).second) {
+                const WeightSource source = {WeightSource::MORPHEME, part, label};
+                grammar.AddArc(from, Arc(c, c, SourceWeight(sources, source,
+                                sources ? 0 : norm - model.LogWeight(label)), end));
+            }
+            if(j == last) break;
+            if(label < 0) { // longer than every cap: only on the whole word path
+                const int k = grammar.AddState();
+                grammar.AddArc(from, Arc(c, c, 0, k));
+                from = k;
+                continue;
+            }
+            auto it = state.find(label);
+            if(it == state.end()) {
+                const int k = grammar.AddState();
+                grammar.AddArc(from, Arc(c, c, 0, k));
+                it = state.insert(std::make_pair(label, k)).first;
+            }
+            from = it->second;
         }
     }
 }
 
-/* Special characters used for marking morpheme boundaries */
-const int mb = (unsigned char)'^'; // morpheme boundary
-const int ss = (unsigned char)'<'; // stem start
-const int se = (unsigned char)'>'; // stem end
-
-void CheckChars(const string& word) {
-    for(char c: word){ 
-        if(c == mb || c == ss || c == se) {
-            std::cerr << "Invalid character ("
-                << (char) mb <<  (char) ss << (char) se << ") "
-                << "in word `" << word << "`\n";
-            exit(1);
-        }   
-    }
-}
+/* Labels used for marking morpheme boundaries, above all character labels */
+const int mb = max_label; // morpheme boundary
+const int ss = max_label + 1; // stem start
+const int se = max_label + 2; // stem end
 
-/* Create a weighted grammar M*MM* from the trie M
- * containing all possible substrings for a word */
+/* Create a weighted grammar M*MM* where M contains
+ * the substrings of word type `w` allowed by `filter`; with `sources`, arcs
+ * are weighted by the index of their weight source instead (see WeightSource) */
 template <typename Arc>
-const fst::VectorFst<Arc> BuildGrammar(const Trie& trie,
+const fst::VectorFst<Arc> BuildGrammar(const SubstringTable& substrings, unsigned w,
         const DirichletMultinomial& prefix_model,
         const DirichletMultinomial& stem_model,
         const DirichletMultinomial& suffix_model,
         const BetaGeometric& prefix_length_model,
-        const BetaGeometric& suffix_length_model) {
+        const BetaGeometric& suffix_length_model,
+        const MorphemeFilter& filter,
+        std::vector<WeightSource>* sources=nullptr) {
     fst::VectorFst<Arc> grammar;
+    if(sources) sources->assign(1, WeightSource {WeightSource::ONE, PREFIX, 0});
 
     // Prefix
-    const float prefix_loop = -log(1 - prefix_length_model.Stop());
-    const float prefix_stop = -log(prefix_length_model.Stop());
+    const float prefix_loop = SourceWeight(sources, WeightSource {WeightSource::LOOP, PREFIX, 0},
+            -log(1 - prefix_length_model.Stop()));
+    const float prefix_stop = SourceWeight(sources, WeightSource {WeightSource::STOP, PREFIX, 0},
+            -log(prefix_length_model.Stop()));
     const int prefix_start = grammar.AddState();
     grammar.SetStart(prefix_start);
     const int prefix1 = grammar.AddState(); // start -> 1 (closure)
     grammar.AddArc(prefix_start, Arc(0, 0, 0, prefix1));
     const int prefix2 = grammar.AddState(); // 1 -> substrings -> 2
-    BuildBanana(trie, prefix1, prefix2, grammar, prefix_model);
+    BuildBanana(substrings, w, prefix1, prefix2, grammar, prefix_model, filter, PREFIX, sources);
     const int prefix3 = grammar.AddState(); // 2 -> 3 / p; 3 -> 1 (closure)
     grammar.AddArc(prefix2, Arc(0, mb, prefix_loop, prefix3)); // morpheme penalty
     grammar.AddArc(prefix3, Arc(0, 0, 0, prefix1)); // closure
@@ -67,17 +115,19 @@ const fst::VectorFst<Arc> BuildGrammar(const Trie& trie,
     const int stem_start = grammar.AddState();
     grammar.AddArc(prefix_end, Arc(0, ss, prefix_stop, stem_start)); // prefix -> suffix
     const int stem_end = grammar.AddState();
-    BuildBanana(trie, stem_start, stem_end, grammar, stem_model);
+    BuildBanana(substrings, w, stem_start, stem_end, grammar, stem_model, filter, STEM, sources);
 
     // Suffix
-    const float suffix_loop = -log(1 - suffix_length_model.Stop());
-    const float suffix_stop = -log(suffix_length_model.Stop());
+    const float suffix_loop = SourceWeight(sources, WeightSource {WeightSource::LOOP, SUFFIX, 0},
+            -log(1 - suffix_length_model.Stop()));
+    const float suffix_stop = SourceWeight(sources, WeightSource {WeightSource::STOP, SUFFIX, 0},
+            -log(suffix_length_model.Stop()));
     const int suffix_start = grammar.AddState();
     grammar.AddArc(stem_end, Arc(0, se, 0, suffix_start)); // stem -> suffix
     const int suffix1 = grammar.AddState(); // start -> 1 (closure)
     grammar.AddArc(suffix_start, Arc(0, 0, 0, suffix1));
     const int suffix2 = grammar.AddState(); // 1 -> substrings -> 2
-    BuildBanana(trie, suffix1, suffix2, grammar, suffix_model);
+    BuildBanana(substrings, w, suffix1, suffix2, grammar, suffix_model, filter, SUFFIX, sources);
     const int suffix3 = grammar.AddState(); // 2 -> 3 / p; 3 -> 1 (closure)
     grammar.AddArc(suffix2, Arc(0, mb, suffix_loop, suffix3)); // morpheme penalty
     grammar.AddArc(suffix3, Arc(0, 0, 0, suffix1)); // closure
@@ -89,15 +139,153 @@ const fst::VectorFst<Arc> BuildGrammar(const Trie& trie,
     return grammar;
 }
 
-/* Create linear chain character acceptor for `word` */
+/* Create linear chain character acceptor for word type `w` */
 template <typename Arc>
-const fst::VectorFst<Arc> LinearChain(const std::string& word) {
+const fst::VectorFst<Arc> LinearChain(const SubstringTable& substrings, unsigned w) {
     fst::VectorFst<Arc> chain;
-    for(unsigned i = 0; i < word.size(); i++) {
+    const int* chars = substrings.Labels(w);
+    for(unsigned i = 0; i < substrings.Length(w); i++) {
         chain.AddState();
-        chain.AddArc(i, Arc((unsigned char) word[i], (unsigned char) word[i], 0, i+1));
+        chain.AddArc(i, Arc(chars[i], chars[i], 0, i+1));
     }
     chain.SetStart(0);
     chain.SetFinal(chain.AddState(), 0);
     return chain;
 }
+
+/* Per-thread scratch space of LatticeSkeleton */
+struct LatticeScratch {
+    std::vector<double> weights; // by weight source
+    std::vector<double> beta; // by state
+    std::vector<int> labels; // output labels of the sampled path
+};
+
+/* Lattice topology of a word type, built once and reweighted at each use
+ * (OpenFst backend). The grammar of the word is built with weight source
+ * indices in place of weights and composed with the word, then trimmed and
+ * topologically sorted, and flattened into arrays. Weights are looked up in
+ * the current models by source, so the forward/backward passes run on the
+ * cached topology without constructing any FST; the skeleton itself is never
+ * modified and can be shared by threads. */
+class LatticeSkeleton {
+    struct Arc {
+        int label; // output label
+        unsigned source, next;
+    };
+    std::vector<unsigned> offsets; // arcs of state s are arcs[offsets[s]:offsets[s+1]]
+    std::vector<Arc> arcs;
+    std::vector<int> finals; // source of the final weight of each state, or -1
+    std::vector<WeightSource> sources;
+
+    static double LogAdd(double x, double y) {
+        if(x == -std::numeric_limits<double>::infinity()) return y;
+        if(y == -std::numeric_limits<double>::infinity()) return x;
+        return (x > y) ? x + log1p(exp(y - x)) : y + log1p(exp(x - y));
+    }
+
+    public:
+    LatticeSkeleton(const SubstringTable& substrings, unsigned w,
+            const DirichletMultinomial& prefix_model,
+            const DirichletMultinomial& stem_model,
+            const DirichletMultinomial& suffix_model,
+            const BetaGeometric& prefix_length_model,
+            const BetaGeometric& suffix_length_model,
+            const MorphemeFilter& filter) {
+        const fst::LogVectorFst grammar = BuildGrammar<fst::LogArc>(substrings, w,
+                prefix_model, stem_model, suffix_model,
+                prefix_length_model, suffix_length_model, filter, &sources);
+        fst::LogVectorFst lattice;
+        fst::Compose(LinearChain<fst::LogArc>(substrings, w), grammar, &lattice);
+        fst::Connect(&lattice);
+        fst::TopSort(&lattice); // acyclic: every grammar cycle reads characters
+
+        // Weights of the composition are the source indices of grammar arcs
+        offsets.push_back(0);
+        for(int s = 0; s < lattice.NumStates(); s++) {
+            for(fst::ArcIterator<fst::LogVectorFst> aiter(lattice, s); !aiter.Done(); aiter.Next()) {
+                const fst::LogArc& arc = aiter.Value();
+                arcs.push_back(Arc {arc.olabel, (unsigned) arc.weight.Value(),
+                        (unsigned) arc.nextstate});
+            }
+            offsets.push_back(arcs.size());
+            const float final = lattice.Final(s).Value();
+            finals.push_back(std::isinf(final) ? -1 : (int) final);
+        }
+        assert(lattice.Start() == 0);
+    }
+
+    unsigned NumStates() const {
+        return finals.size();
+    }
+
+    unsigned NumArcs() const {
+        return arcs.size();
+    }
+
+    /* Weigh the lattice with the given models, divided by `temperature`, and
+     * run the backward pass; returns the total log-weight of the lattice */
+    double Fill(const DirichletMultinomial& prefix_model,
+            const DirichletMultinomial& stem_model,
+            const DirichletMultinomial& suffix_model,
+            const BetaGeometric& prefix_length_model,
+            const BetaGeometric& suffix_length_model,
+            double temperature, LatticeScratch& scratch) const {
+        const DirichletMultinomial* models[3] = {&prefix_model, &stem_model, &suffix_model};
+        const double norms[3] = {prefix_model.LogNormalizer(), stem_model.LogNormalizer(),
+            suffix_model.LogNormalizer()};
+        const double stops[3] = {prefix_length_model.Stop(), 0, suffix_length_model.Stop()};
+        scratch.weights.resize(sources.size());
+        for(unsigned k = 0; k < sources.size(); k++) {
+            const WeightSource& source = sources[k];
+            double weight = 0;
+            if(source.kind == WeightSource::LOOP)
+                weight = log(1 - stops[source.part]);
+            else if(source.kind == WeightSource::STOP)
+                weight = log(stops[source.part]);
+            else if(source.kind == WeightSource::MORPHEME)
+                weight = models[source.part]->LogWeight(source.id) - norms[source.part];
+            scratch.weights[k] = weight / temperature;
+        }
+
+        const double zero = -std::numeric_limits<double>::infinity();
+        scratch.beta.resize(NumStates());
+        for(unsigned s = NumStates(); s-- > 0;) {
+            double beta = (finals[s] >= 0) ? scratch.weights[finals[s]] : zero;
+            for(unsigned a = offsets[s]; a < offsets[s+1]; a++)
+                beta = LogAdd(beta, scratch.weights[arcs[a].source] + scratch.beta[arcs[a].next]);
+            scratch.beta[s] = beta;
+        }
+        return scratch.beta[0];
+    }
+
+    /* Sample a path of the filled lattice into `scratch.labels`, or with
+     * `uniform`, a path choosing uniformly among the arcs (and final
+     * weight) of each state, without filling the lattice */
+    void Sample(std::mt19937& engine, bool uniform, LatticeScratch& scratch) const {
+        scratch.labels.clear();
+        for(unsigned s = 0;;) {
+            const unsigned n = offsets[s+1] - offsets[s];
+            unsigned a = offsets[s];
+            if(uniform) {
+                const unsigned k = prob::randint(engine, 0, n - (finals[s] < 0));
+                if(k == n) return;
+                a += k;
+            }
+            else {
+                double x = prob::random(engine);
+                if(finals[s] >= 0) {
+                    x -= exp(scratch.weights[finals[s]] - scratch.beta[s]);
+                    if(x < 0) return;
+                }
+                for(; a + 1 < offsets[s+1]; a++) {
+                    x -= exp(scratch.weights[arcs[a].source] + scratch.beta[arcs[a].next]
+                            - scratch.beta[s]);
+                    if(x < 0) break;
+                }
+                if(n == 0) return; // rounding error on a final state
+            }
+            scratch.labels.push_back(arcs[a].label);
+            s = arcs[a].next;
+        }
+    }
+};
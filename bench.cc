@@ -0,0 +1,289 @@
+#include <fst/fstlib.h>
+#include <thread>
+#include <chrono>
+#include <sstream>
+#include <unordered_set>
+#include <cstdlib>
+#include "thread_pool.h"
+#include "utf8.h"
+#include "stats.h"
+#include "vocabulary.h"
+#include "corpus.h"
+#include "prob.h"
+#include "substrings.h"
+#include "morphemes.h"
+#include "segmentations.h"
+#include "banana.h"
+#include "chart.h"
+#include "pss_model.h"
+#include "lexicon.h"
+#include "schedule.h"
+
+/* Benchmarks of the sampler stages on a synthetic corpus
+ * The corpus is generated deterministically from a seed: word types are
+ * concatenations of an optional prefix, a stem and an optional suffix drawn
+ * from random inventories, with geometric stem lengths, and tokens follow a
+ * Zipfian distribution over types. Each benchmark prints one JSON line
+ * (best time of --repeat runs) so that results can be diffed between builds. */
+
+struct Config {
+    unsigned types = 20000, tokens = 200000, sentence_length = 20;
+    double zipf = 1.0, mean_length = 6; // Zipf exponent, mean stem length
+    unsigned max_length = 20, seed = 42, max_threads = 8, repeat = 3, iterations = 2;
+    bool openfst = true;
+};
+
+/* Deterministic generator: only uses the raw output of mt19937, which is fully
+ * specified by the standard (unlike the standard distributions) */
+class SyntheticCorpus {
+    std::mt19937 engine;
+
+    double Uniform() {
+        return engine() / 4294967296.0;
+    }
+
+    std::string Morpheme(unsigned length) {
+        std::string m;
+        for(unsigned i = 0; i < length; i++)
+            m += 'a' + engine() % 26;
+        return m;
+    }
+
+    public:
+    SyntheticCorpus(unsigned seed) : engine(seed) {}
+
+    /* One sentence per line */
+    std::string Generate(const Config& config) {
+        std::vector<std::string> prefixes, stems, suffixes;
+        for(unsigned k = 0; k < 50; k++)
+            prefixes.push_back(Morpheme(1 + engine() % 3));
+        for(unsigned k = 0; k < 100; k++)
+            suffixes.push_back(Morpheme(1 + engine() % 4));
+        const double p = 1 / config.mean_length; // stem length ~ Geometric(p) >= 1
+        for(unsigned k = 0; k < config.types / 2 + 1; k++) {
+            unsigned length = 1;
+            while(length < config.max_length && Uniform() > p) length++;
+            stems.push_back(Morpheme(length));
+        }
+
+        std::vector<std::string> types;
+        std::unordered_set<std::string> seen;
+        for(unsigned attempts = 0; types.size() < config.types && attempts < 100 * config.types; attempts++) {
+            std::string word;
+            if(Uniform() < 0.3) word += prefixes[engine() % prefixes.size()];
+            word += stems[engine() % stems.size()];
+            if(Uniform() < 0.6) word += suffixes[engine() % suffixes.size()];
+            if(seen.insert(word).second) types.push_back(word);
+        }
+
+        std::vector<double> cdf(types.size());
+        double total = 0;
+        for(unsigned r = 0; r < types.size(); r++)
+            cdf[r] = (total += pow(r + 1, -config.zipf));
+        std::string text;
+        for(unsigned i = 0; i < config.tokens; i++) {
+            const unsigned r = std::upper_bound(cdf.begin(), cdf.end(), Uniform() * total) - cdf.begin();
+            text += types[std::min<size_t>(r, types.size() - 1)];
+            text += ((i + 1) % config.sentence_length == 0) ? '\n' : ' ';
+        }
+        return text;
+    }
+};
+
+/* Run f() `repeat` times and print the best time as a JSON line */
+template <typename F>
+void Measure(const std::string& name, size_t items, unsigned threads, unsigned repeat, F f) {
+    double best = std::numeric_limits<double>::infinity();
+    for(unsigned r = 0; r < repeat; r++) {
+        const auto start = std::chrono::steady_clock::now();
+        f();
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        best = std::min(best, elapsed.count());
+    }
+    std::cout << "{\"benchmark\": \"" << name << "\", \"threads\": " << threads
+        << ", \"items\": " << items << ", \"seconds\": " << best
+        << ", \"items_per_second\": " << items / best << "}" << std::endl;
+}
+
+int main(int argc, char** argv) {
+    Config config;
+    for(int i = 1; i < argc; i++) {
+        const std::string option = argv[i];
+        if(option == "--skip-openfst") {
+            config.openfst = false;
+            continue;
+        }
+        if(i+1 >= argc) {
+            std::cerr << "Usage: " << argv[0] << " [options]\n"
+                << "Options:\n"
+                << "  --types N         number of word types (default: 20000)\n"
+                << "  --tokens N        number of tokens (default: 200000)\n"
+                << "  --zipf S          exponent of the type distribution (default: 1)\n"
+                << "  --mean-length L   mean stem length (default: 6)\n"
+                << "  --max-length L    maximum stem length (default: 20)\n"
+                << "  --seed N          corpus generator seed (default: 42)\n"
+                << "  --max-threads N   largest thread count for end-to-end runs (default: 8)\n"
+                << "  --repeat N        runs per benchmark, the best is kept (default: 3)\n"
+                << "  --iterations N    Gibbs iterations per end-to-end run (default: 2)\n"
+                << "  --skip-openfst    only benchmark the native backend\n";
+            exit(1);
+        }
+        const char* value = argv[++i];
+        if(option == "--types") config.types = atoi(value);
+        else if(option == "--tokens") config.tokens = atoi(value);
+        else if(option == "--zipf") config.zipf = atof(value);
+        else if(option == "--mean-length") config.mean_length = std::max(1.0, atof(value));
+        else if(option == "--max-length") config.max_length = std::max(1, atoi(value));
+        else if(option == "--seed") config.seed = atoi(value);
+        else if(option == "--max-threads") config.max_threads = std::max(1, atoi(value));
+        else if(option == "--repeat") config.repeat = std::max(1, atoi(value));
+        else if(option == "--iterations") config.iterations = std::max(1, atoi(value));
+        else {
+            std::cerr << "Unknown option `" << option << "`\n";
+            exit(1);
+        }
+    }
+
+    const std::string text = SyntheticCorpus(config.seed).Generate(config);
+    std::cout << "{\"benchmark\": \"config\", \"types\": " << config.types
+        << ", \"tokens\": " << config.tokens << ", \"zipf\": " << config.zipf
+        << ", \"mean_length\": " << config.mean_length
+        << ", \"max_length\": " << config.max_length
+        << ", \"seed\": " << config.seed << ", \"bytes\": " << text.size() << "}" << std::endl;
+
+    const float alpha_prefix = 1e-4, alpha_stem = 1e-3, alpha_suffix = 1e-4;
+    ThreadPool pool(1);
+
+    /* Loading and substring tables */
+    Measure("load", config.tokens, 1, config.repeat, [&] {
+        Vocabulary vocabulary;
+        std::istringstream input(text);
+        Corpus corpus(input, vocabulary);
+    });
+    Vocabulary word_vocabulary;
+    std::istringstream input(text);
+    const Corpus corpus(input, word_vocabulary);
+    const std::vector<unsigned>& tokens = corpus.TokenIds();
+    const unsigned n_types = word_vocabulary.Size();
+
+    Measure("substrings", n_types, 1, config.repeat, [&] {
+        SubstringVocabulary vocabulary;
+        SubstringTable table;
+        table.Build(word_vocabulary, vocabulary, pool);
+    });
+    SubstringVocabulary substring_vocabulary;
+    SubstringTable substrings;
+    substrings.Build(word_vocabulary, substring_vocabulary, pool);
+
+    /* Lattice stages, under the counts of a random initial segmentation */
+    SegmentationModel model(alpha_prefix, alpha_stem, alpha_suffix,
+            word_vocabulary, substring_vocabulary.Size(), substrings);
+    std::mt19937 engine(config.seed);
+    Chart chart;
+    SegmentationStore segs(substrings, tokens);
+    Segmentation current, sampled;
+    for(size_t i = 0; i < tokens.size(); i++) {
+        model.Increment(tokens[i], engine, chart, sampled, true);
+        segs.Set(i, sampled);
+    }
+    model.Synchronize();
+
+    if(config.openfst) {
+        Measure("build_grammar", n_types, 1, config.repeat, [&] {
+            for(unsigned w = 0; w < n_types; w++)
+                BuildGrammar<fst::LogArc>(substrings, w,
+                        model.prefix_model, model.stem_model, model.suffix_model,
+                        model.prefix_length_model, model.suffix_length_model, model.filter);
+        });
+        Measure("make_lattice", n_types, 1, config.repeat, [&] {
+            for(unsigned w = 0; w < n_types; w++)
+                model.MakeLattice<fst::LogArc>(w);
+        });
+    }
+    Measure("fill_chart", n_types, 1, config.repeat, [&] {
+        for(unsigned w = 0; w < n_types; w++) {
+            chart.Load(substrings, w);
+            chart.Fill(model.prefix_model, model.stem_model, model.suffix_model,
+                    model.prefix_length_model, model.suffix_length_model, model.filter);
+        }
+    });
+
+    std::vector<Backend> backends(1, NATIVE);
+    if(config.openfst) backends.push_back(OPENFST);
+    for(Backend backend: backends) {
+        const std::string suffix = (backend == NATIVE) ? "_native" : "_openfst";
+        model.backend = backend;
+        Measure("increment" + suffix, tokens.size(), 1, config.repeat, [&] {
+            for(size_t i = 0; i < tokens.size(); i++) {
+                segs.Get(i, current);
+                model.Decrement(tokens[i], current);
+                model.Increment(tokens[i], engine, chart, sampled);
+                segs.Set(i, sampled);
+            }
+            model.Synchronize();
+        });
+        Measure("decode" + suffix, n_types, 1, config.repeat, [&] {
+            for(unsigned w = 0; w < n_types; w++)
+                model.Decode(w, chart);
+        });
+    }
+    model.backend = NATIVE;
+
+    /* Prefix/suffix model of prefsuf */
+    {
+        Vocabulary prefix_vocabulary, suffix_vocabulary;
+        for(const std::string& word: word_vocabulary)
+            for(unsigned split = 0; split <= word.size(); split++) {
+                prefix_vocabulary.Encode(word.substr(0, split));
+                suffix_vocabulary.Encode(word.substr(split));
+            }
+        LexiconModel lexicon(0.001, 0.001, word_vocabulary, prefix_vocabulary, suffix_vocabulary);
+        std::vector<unsigned> splits;
+        for(unsigned w: tokens)
+            splits.push_back(lexicon.Increment(w, engine, true));
+        Measure("lexicon_increment", tokens.size(), 1, config.repeat, [&] {
+            for(size_t i = 0; i < tokens.size(); i++) {
+                lexicon.Decrement(tokens[i], splits[i]);
+                splits[i] = lexicon.Increment(tokens[i], engine);
+            }
+        });
+        Measure("lexicon_decode", n_types, 1, config.repeat, [&] {
+            for(unsigned w = 0; w < n_types; w++)
+                lexicon.Decode(w);
+        });
+    }
+
+    /* End-to-end: exact parallel Gibbs iterations, as run by segment */
+    std::vector<unsigned> type_start(n_types + 1, 0), type_tokens(tokens.size());
+    for(unsigned w: tokens)
+        type_start[w+1]++;
+    for(unsigned w = 0; w < n_types; w++)
+        type_start[w+1] += type_start[w];
+    std::vector<unsigned> next(type_start.begin(), type_start.end() - 1);
+    for(unsigned i = 0; i < tokens.size(); i++)
+        type_tokens[next[tokens[i]]++] = i;
+    std::vector<double> costs(n_types);
+    for(unsigned w = 0; w < n_types; w++)
+        costs[w] = LatticeCost(model.filter, substrings.Length(w));
+    for(unsigned n_threads = 1; n_threads <= config.max_threads; n_threads *= 2) {
+        ThreadPool threads(n_threads);
+        const Schedule schedule(costs, type_start, type_tokens, 16 * n_threads);
+        std::vector<std::mt19937> engines;
+        for(unsigned k = 0; k < n_threads; k++)
+            engines.emplace_back(config.seed + k);
+        std::vector<Chart> charts(n_threads);
+        std::vector<Segmentation> currents(n_threads), samples(n_threads);
+        Measure("sampler", config.iterations * tokens.size(), n_threads, config.repeat, [&] {
+            for(unsigned it = 0; it < config.iterations; it++) {
+                schedule.Enqueue(threads, [&] (unsigned i, unsigned thread) {
+                    segs.Get(i, currents[thread]);
+                    model.Decrement(tokens[i], currents[thread]);
+                    model.Increment(tokens[i], engines[thread], charts[thread], samples[thread]);
+                    segs.Set(i, samples[thread]);
+                });
+                threads.wait();
+                model.Synchronize();
+            }
+        });
+    }
+}
@@ -0,0 +1,141 @@
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <cstdlib>
+#include "prob.h"
+
+/* Contention benchmark for the Dirichlet-multinomial counters
+ * Every thread repeatedly decrements a count, evaluates a few posterior
+ * predictive probabilities and increments a count, like the sampler does
+ * for each morpheme: it only decrements ids it has incremented itself, so
+ * that no count goes below zero. Prints updates per second for 1 to 64
+ * threads, after checking the final counts against a serial run. */
+
+/* The previous implementation: one mutex around the whole count vector */
+struct LockedDirichletMultinomial {
+    LockedDirichletMultinomial(unsigned size, float concentration)
+        : K(size), alpha(concentration), N(0), count(size) {}
+
+    void Increment(unsigned k) {
+        std::lock_guard<std::mutex> guard(count_lock);
+        count[k]++;
+        N++;
+    }
+
+    void Decrement(unsigned k) {
+        std::lock_guard<std::mutex> guard(count_lock);
+        count[k]--;
+        N--;
+    }
+
+    float Prob(unsigned k) const {
+        return (alpha + count[k])/(K * alpha + N);
+    }
+
+    void Synchronize() {}
+
+    template <typename F>
+    void ForEach(F f) const {
+        for(unsigned k = 0; k < K; k++)
+            if(count[k] > 0) f(k, count[k]);
+    }
+
+    double LogLikelihood() const {
+        double ll = lgamma(K * alpha) - lgamma(K * alpha + N);
+        for(unsigned c: count)
+            if(c > 0) ll += lgamma(alpha + c) - lgamma(alpha);
+        return ll;
+    }
+
+    unsigned K;
+    float alpha;
+    unsigned N;
+    std::vector<unsigned> count;
+    std::mutex count_lock;
+};
+
+const unsigned K = 1000000;
+const unsigned n_updates = 1000000; // per thread
+const unsigned n_recent = 1024; // per thread: ids incremented and not decremented yet
+
+// Zipfian-like ids: a few very frequent morphemes, as in real corpora
+unsigned Draw(std::mt19937& engine) {
+    return (unsigned) (K * pow(prob::random(engine), 4)) % K;
+}
+
+/* The updates of thread t: each decrements the oldest of the ids the
+ * thread has incremented and increments a new one in its place */
+template <typename Model>
+void Update(Model& model, unsigned t) {
+    std::mt19937 engine(t);
+    std::vector<unsigned> recent(n_recent);
+    for(unsigned& k: recent) {
+        k = Draw(engine);
+        model.Increment(k);
+    }
+    float sum = 0;
+    for(unsigned i = 0; i < n_updates; i++) {
+        unsigned& k = recent[i % n_recent];
+        model.Decrement(k);
+        for(unsigned j = 0; j < 4; j++)
+            sum += model.Prob(Draw(engine));
+        k = Draw(engine);
+        model.Increment(k);
+    }
+    if(sum < 0) std::cerr << sum;
+}
+
+template <typename Model>
+double Run(Model& model, unsigned n_threads) {
+    for(unsigned k = 0; k < K; k++)
+        model.Increment(k);
+    model.Synchronize();
+
+    std::vector<std::thread> threads;
+    const auto start = std::chrono::steady_clock::now();
+    for(unsigned t = 0; t < n_threads; t++)
+        threads.emplace_back([&model, t] { Update(model, t); });
+    for(auto& thread: threads)
+        thread.join();
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    model.Synchronize();
+    return 2.0 * n_updates * n_threads / elapsed.count();
+}
+
+/* The final counts only depend on the updates of each thread, not on
+ * their interleaving: compare them with the same updates run serially */
+template <typename Model>
+void Check(const char* name, const Model& model, const DirichletMultinomial& reference) {
+    unsigned support = 0, reference_support = 0;
+    model.ForEach([&support] (unsigned k, unsigned c) { support++; });
+    reference.ForEach([&reference_support] (unsigned k, unsigned c) { reference_support++; });
+    const double ll = model.LogLikelihood(), reference_ll = reference.LogLikelihood();
+    if(support != reference_support || !(fabs(ll - reference_ll) <= 1e-6 * fabs(reference_ll))) {
+        std::cerr << name << ": |support|=" << support << " LL=" << ll
+            << " instead of |support|=" << reference_support << " LL=" << reference_ll << "\n";
+        exit(1);
+    }
+}
+
+int main(int argc, char** argv) {
+    const unsigned max_threads = (argc > 1) ? atoi(argv[1]) : 64;
+    std::cout << "threads\tmutex\tatomic\trelaxed\n";
+    for(unsigned n_threads = 1; n_threads <= max_threads; n_threads *= 2) {
+        DirichletMultinomial reference(K, 1e-3);
+        for(unsigned k = 0; k < K; k++)
+            reference.Increment(k);
+        for(unsigned t = 0; t < n_threads; t++)
+            Update(reference, t);
+        reference.Synchronize();
+
+        LockedDirichletMultinomial locked(K, 1e-3);
+        DirichletMultinomial exact(K, 1e-3), relaxed(K, 1e-3, true);
+        std::cout << n_threads
+            << "\t" << Run(locked, n_threads)
+            << "\t" << Run(exact, n_threads)
+            << "\t" << Run(relaxed, n_threads) << "\n";
+        Check("mutex", locked, reference);
+        Check("atomic", exact, reference);
+        Check("relaxed", relaxed, reference);
+    }
+}
@@ -0,0 +1,342 @@
+#include <vector>
+#include <string>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <random>
+
+/* Native forward-filtering/backward-sampling over the M*MM* grammar
+ *
+ * The lattice built by BuildGrammar and composed with the word is a chain of
+ * prefix*, stem, suffix* spans over character positions 0..L, so it can be
+ * handled directly with dynamic programming on positions:
+ *   prefix[i] = weight of all prefix sequences covering word[0:i]
+ *   suffix[j] = weight of all suffix sequences covering word[j:L] (with stop)
+ *   stem(i, j) = prefix[i] + p_stop + stem weight of word[i:j] + suffix[j]
+ * Spans that are not allowed morphemes (morphemes.h) have weight zero and
+ * the passes only visit spans within the length caps.
+ * All weights are log-probabilities. A Chart is scratch space owned by a
+ * single thread and reused across words to avoid allocation; it also carries
+ * the performance counters of that thread, if any (stats.h). */
+
+class Chart {
+    unsigned L;
+    const int* ids; // triangular substring ids of the word (substrings.h)
+    std::vector<double> prefix_weight, suffix_weight; // L x L: [i*L + j-1] = word[i:j]
+    std::vector<double> stem_weight; // L x L, including the prefix stop weight
+    std::vector<double> prefix, suffix, stem; // stem is L x L like prefix_weight
+    std::vector<double> scores; // candidate scores for one draw
+    std::vector<double> stem_cdf; // cumulative stem span probabilities, built lazily
+    double prefix_loop, suffix_loop, total;
+    unsigned max_prefix, max_suffix; // length caps for the current word
+    unsigned n_arcs; // allowed spans
+    bool viterbi;
+
+    /* n-best lists of prefix (suffix) sequences ending (starting) at each
+     * position: the last (first) morpheme spans [next, i) ([i, next)) and
+     * continues with entry `rank` of the list at `next` */
+    struct Path {
+        double weight;
+        unsigned next, rank;
+        bool operator<(const Path& other) const { return weight > other.weight; }
+    };
+    std::vector< std::vector<Path> > prefix_paths, suffix_paths;
+    std::vector<Path> candidates;
+
+    /* Keep the n best candidates, sorted */
+    void Prune(unsigned n, std::vector<Path>& paths) {
+        const unsigned m = std::min<size_t>(n, candidates.size());
+        std::partial_sort(candidates.begin(), candidates.begin() + m, candidates.end());
+        paths.assign(candidates.begin(), candidates.begin() + m);
+    }
+
+    static double LogAdd(double x, double y) {
+        if(x == -std::numeric_limits<double>::infinity()) return y;
+        if(y == -std::numeric_limits<double>::infinity()) return x;
+        return (x > y) ? x + log1p(exp(y - x)) : y + log1p(exp(x - y));
+    }
+
+    double Plus(double x, double y) const {
+        return viterbi ? std::max(x, y) : LogAdd(x, y);
+    }
+
+    /* Choose one of `scores` summing to `sum`: the argmax for Viterbi,
+     * otherwise a sample proportional to exp(score) */
+    unsigned Pick(double sum, std::mt19937* engine) const {
+        unsigned best = 0;
+        for(unsigned k = 1; k < scores.size(); k++)
+            if(scores[k] > scores[best]) best = k;
+        if(viterbi || engine == nullptr) return best;
+        double x = prob::random(*engine);
+        for(unsigned k = 0; k < scores.size(); k++) {
+            x -= exp(scores[k] - sum);
+            if(x < 0) return k;
+        }
+        return best; // rounding error: fall back on the heaviest candidate
+    }
+
+    public:
+    Chart() : L(0), ids(nullptr), prefix_loop(0), suffix_loop(0), total(0),
+        max_prefix(0), max_suffix(0), n_arcs(0), viterbi(false), stats(nullptr) {}
+
+    ThreadStats* stats; // telemetry of the owning thread, null if disabled
+    LatticeScratch lattice; // scratch space of the OpenFst backend (banana.h)
+
+    /* Id of the substring word[i:j] */
+    int Id(unsigned i, unsigned j) const {
+        return ids[SubstringTable::Index(L, i, j)];
+    }
+
+    /* Point the chart to the substrings of word type `w` */
+    void Load(const SubstringTable& substrings, unsigned w) {
+        L = substrings.Length(w);
+        ids = substrings.Ids(w);
+    }
+
+    /* Point the chart to the triangular array of substring ids of a word of
+     * length `length` (e.g. a word that is not in the substring table) */
+    void Load(unsigned length, const int* word_ids) {
+        L = length;
+        ids = word_ids;
+    }
+
+    /* Number of morpheme spans of the lattice last filled */
+    unsigned Arcs() const {
+        return n_arcs;
+    }
+
+    /* Run the forward/backward passes with the given models and return the
+     * total log-weight of the lattice (its best path weight if `max` is set),
+     * over the morphemes allowed by `filter`.
+     * With `uniform` all morphemes and lengths get the same weight; otherwise
+     * weights are divided by `temperature` (annealing). */
+    template <typename Model, typename LengthModel>
+    double Fill(const Model& prefix_model, const Model& stem_model,
+            const Model& suffix_model,
+            const LengthModel& prefix_length_model,
+            const LengthModel& suffix_length_model,
+            const MorphemeFilter& filter,
+            bool max=false, bool uniform=false, double temperature=1) {
+        viterbi = max;
+        const double beta = uniform ? 0 : 1 / temperature;
+        max_prefix = filter.MaxLength(PREFIX, L);
+        max_suffix = filter.MaxLength(SUFFIX, L);
+        const unsigned max_stem = filter.MaxLength(STEM, L);
+        n_arcs = 0;
+        const double zero = -std::numeric_limits<double>::infinity();
+        prefix_loop = uniform ? 0 : beta * log(1 - prefix_length_model.Stop());
+        suffix_loop = uniform ? 0 : beta * log(1 - suffix_length_model.Stop());
+        const double prefix_stop = uniform ? 0 : beta * log(prefix_length_model.Stop());
+        const double suffix_stop = uniform ? 0 : beta * log(suffix_length_model.Stop());
+        const double prefix_norm = uniform ? 0 : prefix_model.LogNormalizer();
+        const double stem_norm = uniform ? 0 : stem_model.LogNormalizer();
+        const double suffix_norm = uniform ? 0 : suffix_model.LogNormalizer();
+
+        prefix_weight.assign(L * L, zero);
+        suffix_weight.assign(L * L, zero);
+        stem_weight.assign(L * L, zero);
+        prefix.assign(L+1, zero);
+        prefix[0] = 0;
+        for(unsigned i = 1; i <= L; i++)
+            for(unsigned k = i - std::min(i, max_prefix); k < i; k++) {
+                const int id = Id(k, i);
+                if(!filter.Allows(PREFIX, L, k, i, id)) continue;
+                const unsigned s = k * L + i-1;
+                prefix_weight[s] = prefix_loop
+                    + (uniform ? 0 : beta * (prefix_model.LogWeight(id) - prefix_norm));
+                prefix[i] = Plus(prefix[i], prefix[k] + prefix_weight[s]);
+                n_arcs++;
+            }
+
+        suffix.assign(L+1, zero);
+        suffix[L] = suffix_stop;
+        for(unsigned j = L; j-- > 0;)
+            for(unsigned k = j+1; k <= std::min(L, j + max_suffix); k++) {
+                const int id = Id(j, k);
+                if(!filter.Allows(SUFFIX, L, j, k, id)) continue;
+                const unsigned s = j * L + k-1;
+                suffix_weight[s] = suffix_loop
+                    + (uniform ? 0 : beta * (suffix_model.LogWeight(id) - suffix_norm));
+                suffix[j] = Plus(suffix[j], suffix_weight[s] + suffix[k]);
+                n_arcs++;
+            }
+
+        stem.assign(L * L, zero);
+        stem_cdf.clear();
+        total = zero;
+        for(unsigned i = 0; i < L; i++)
+            for(unsigned j = i+1; j <= L; j++) {
+                if(j - i > max_stem) { // only the whole word remains
+                    if(i > 0) break;
+                    j = L;
+                }
+                const unsigned s = i * L + j-1;
+                stem_weight[s] = prefix_stop
+                    + (uniform ? 0 : beta * (stem_model.LogWeight(Id(i, j)) - stem_norm));
+                stem[s] = prefix[i] + stem_weight[s] + suffix[j];
+                total = Plus(total, stem[s]);
+                n_arcs++;
+            }
+        return total;
+    }
+
+    /* Read a segmentation off the filled chart: a sample drawn with `engine`,
+     * or the best one if the chart was filled with `max` or `engine` is null.
+     * Can be called repeatedly on the same chart; returns the path log-weight */
+    double Trace(std::vector<unsigned>& prefixes, unsigned& stem_id,
+            std::vector<unsigned>& suffixes, std::mt19937* engine=nullptr) {
+        // Stem span
+        unsigned span;
+        if(viterbi || engine == nullptr) {
+            scores.assign(stem.begin(), stem.end());
+            span = Pick(total, nullptr);
+        }
+        else {
+            if(stem_cdf.empty()) {
+                stem_cdf.resize(L * L);
+                double cumulative = 0;
+                for(unsigned s = 0; s < L * L; s++)
+                    stem_cdf[s] = (cumulative += exp(stem[s] - total));
+            }
+            span = std::upper_bound(stem_cdf.begin(), stem_cdf.end(),
+                    prob::random(*engine) * stem_cdf.back()) - stem_cdf.begin();
+            span = std::min(span, L * L - 1);
+            while(stem[span] == -std::numeric_limits<double>::infinity()) span--;
+        }
+        const unsigned start = span / L, end = span % L + 1;
+        stem_id = Id(start, end);
+        double weight = stem[span] - prefix[start] - suffix[end] + suffix[L];
+
+        // Prefixes, right to left
+        prefixes.clear();
+        for(unsigned i = start; i > 0;) {
+            const unsigned first = i - std::min(i, max_prefix);
+            scores.resize(i - first);
+            for(unsigned k = first; k < i; k++)
+                scores[k-first] = prefix[k] + prefix_weight[k * L + i-1];
+            const unsigned k = first + Pick(prefix[i], engine);
+            prefixes.push_back(Id(k, i));
+            weight += prefix_weight[k * L + i-1];
+            i = k;
+        }
+        std::reverse(prefixes.begin(), prefixes.end());
+
+        // Suffixes, left to right
+        suffixes.clear();
+        for(unsigned j = end; j < L;) {
+            scores.resize(std::min(L - j, max_suffix));
+            for(unsigned k = j+1; k <= j + scores.size(); k++)
+                scores[k-j-1] = suffix_weight[j * L + k-1] + suffix[k];
+            const unsigned k = j + 1 + Pick(suffix[j], engine);
+            suffixes.push_back(Id(j, k));
+            weight += suffix_weight[j * L + k-1];
+            j = k;
+        }
+        return weight;
+    }
+
+    /* Log-weight of the path of a given segmentation in the filled chart, as
+     * Trace returns it when it reads that segmentation; -inf if the chart has
+     * no such path (e.g. a morpheme beyond the length caps, whose span has
+     * weight zero) */
+    double Weight(const std::vector<unsigned>& prefixes, unsigned stem_id,
+            const std::vector<unsigned>& suffixes) const {
+        const double zero = -std::numeric_limits<double>::infinity();
+        // End of the span of morpheme `id` starting at i, or 0 if none
+        auto end = [this] (unsigned i, unsigned id) -> unsigned {
+            for(unsigned k = i+1; k <= L; k++)
+                if(Id(i, k) == (int) id) return k;
+            return 0u;
+        };
+        double weight = suffix[L];
+        unsigned i = 0;
+        for(unsigned p: prefixes) {
+            const unsigned k = end(i, p);
+            if(k == 0) return zero;
+            weight += prefix_weight[i * L + k-1];
+            i = k;
+        }
+        unsigned j = end(i, stem_id);
+        if(j == 0) return zero;
+        weight += stem_weight[i * L + j-1];
+        for(unsigned s: suffixes) {
+            const unsigned k = end(j, s);
+            if(k == 0) return zero;
+            weight += suffix_weight[j * L + k-1];
+            j = k;
+        }
+        return (j == L) ? weight : zero;
+    }
+
+    /* The n best segmentations of the filled chart, best first, with their
+     * log-weights; returns how many there are (fewer than n for short words
+     * or tight morpheme constraints) */
+    unsigned NBest(unsigned n, std::vector< std::vector<unsigned> >& prefixes,
+            std::vector<unsigned>& stems, std::vector< std::vector<unsigned> >& suffixes,
+            std::vector<double>& weights) {
+        const double zero = -std::numeric_limits<double>::infinity();
+        prefix_paths.resize(L+1);
+        prefix_paths[0].assign(1, Path {0, 0, 0});
+        for(unsigned i = 1; i <= L; i++) {
+            candidates.clear();
+            for(unsigned k = i - std::min(i, max_prefix); k < i; k++)
+                if(prefix_weight[k * L + i-1] != zero)
+                    for(unsigned r = 0; r < prefix_paths[k].size(); r++)
+                        candidates.push_back(Path {prefix_paths[k][r].weight
+                                + prefix_weight[k * L + i-1], k, r});
+            Prune(n, prefix_paths[i]);
+        }
+
+        suffix_paths.resize(L+1);
+        suffix_paths[L].assign(1, Path {suffix[L], L, 0}); // suffix[L] is the stop weight
+        for(unsigned j = L; j-- > 0;) {
+            candidates.clear();
+            for(unsigned k = j+1; k <= std::min(L, j + max_suffix); k++)
+                if(suffix_weight[j * L + k-1] != zero)
+                    for(unsigned r = 0; r < suffix_paths[k].size(); r++)
+                        candidates.push_back(Path {suffix_weight[j * L + k-1]
+                                + suffix_paths[k][r].weight, k, r});
+            Prune(n, suffix_paths[j]);
+        }
+
+        // Stem spans: combining prefix rank a and suffix rank b, only
+        // (a+1)(b+1) <= n can make it into the n best
+        std::vector<Path> best;
+        candidates.clear();
+        for(unsigned i = 0; i < L; i++)
+            for(unsigned j = i+1; j <= L; j++)
+                if(stem_weight[i * L + j-1] != zero)
+                    for(unsigned a = 0; a < prefix_paths[i].size(); a++)
+                        for(unsigned b = 0; b < suffix_paths[j].size() && (a+1) * (b+1) <= n; b++)
+                            candidates.push_back(Path {prefix_paths[i][a].weight
+                                    + stem_weight[i * L + j-1] + suffix_paths[j][b].weight,
+                                    i * L + j-1, a * n + b});
+        Prune(n, best);
+
+        prefixes.resize(best.size());
+        stems.resize(best.size());
+        suffixes.resize(best.size());
+        weights.resize(best.size());
+        for(unsigned m = 0; m < best.size(); m++) {
+            const unsigned start = best[m].next / L, end = best[m].next % L + 1;
+            stems[m] = Id(start, end);
+            weights[m] = best[m].weight;
+            prefixes[m].clear();
+            for(unsigned i = start, r = best[m].rank / n; i > 0;) {
+                const Path& path = prefix_paths[i][r];
+                prefixes[m].push_back(Id(path.next, i));
+                i = path.next;
+                r = path.rank;
+            }
+            std::reverse(prefixes[m].begin(), prefixes[m].end());
+            suffixes[m].clear();
+            for(unsigned j = end, r = best[m].rank % n; j < L;) {
+                const Path& path = suffix_paths[j][r];
+                suffixes[m].push_back(Id(j, path.next));
+                j = path.next;
+                r = path.rank;
+            }
+        }
+        return best.size();
+    }
+};
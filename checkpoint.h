@@ -0,0 +1,282 @@
+#include <vector>
+#include <string>
+#include <sstream>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/* Binary checkpoints of the complete sampler state
+ * A checkpoint is a header followed by a table of contents and a fixed list
+ * of sections, each a flat array of plain values aligned on 8 bytes, so that
+ * the file can be memory-mapped and every array copied out in bulk:
+ * vocabularies, substring table, tokens with their current segmentations,
+ * model counts and the state of the per-thread random engines.
+ * Checkpoints are written to a temporary file renamed at the end, so an
+ * interrupted write never clobbers the previous one. */
+
+class Checkpoint {
+    enum Section {
+        INFO,
+        WORDS, WORD_OFFSETS,
+        SUBSTRINGS, SUBSTRING_OFFSETS, SUBSTRING_HASHES, SUBSTRING_SLOTS,
+        TABLE_OFFSETS, TABLE_LENGTHS, TABLE_IDS,
+        TABLE_CHAR_OFFSETS, TABLE_LABELS, TABLE_BOUNDS,
+        TOKENS, SEGMENT_OFFSETS, SEGMENTS,
+        PREFIX_COUNTS, STEM_COUNTS, SUFFIX_COUNTS, LENGTH_COUNTS,
+        ENGINES,
+        N_SECTIONS
+    };
+
+    struct Header {
+        char magic[8];
+        uint32_t version, n_sections;
+        uint64_t offset[N_SECTIONS], size[N_SECTIONS]; // in bytes
+    };
+
+    static const uint32_t version = 3;
+
+    const char* data;
+    size_t length;
+    const Header* header;
+
+    template <typename T>
+    static void Write(std::ofstream& out, Header& header, Section s, const T* values, size_t n) {
+        const size_t padding = (8 - out.tellp() % 8) % 8;
+        const char zeros[8] = {0};
+        out.write(zeros, padding);
+        header.offset[s] = out.tellp();
+        header.size[s] = n * sizeof(T);
+        out.write(reinterpret_cast<const char*>(values), n * sizeof(T));
+    }
+
+    template <typename T>
+    static void Write(std::ofstream& out, Header& header, Section s, const std::vector<T>& values) {
+        Write(out, header, s, values.data(), values.size());
+    }
+
+    /* Copy section `s` out of the mapped file */
+    template <typename T>
+    void Read(Section s, std::vector<T>& values) const {
+        values.resize(header->size[s] / sizeof(T));
+        memcpy(values.data(), data + header->offset[s], header->size[s]);
+    }
+
+    static std::vector<uint32_t> Counts(const DirichletMultinomial& model) {
+        std::vector<uint32_t> counts;
+        model.ForEach([&counts] (unsigned k, unsigned c) {
+            counts.push_back(k);
+            counts.push_back(c);
+        });
+        return counts;
+    }
+
+    void ReadCounts(Section s, DirichletMultinomial& model) const {
+        std::vector<uint32_t> counts;
+        Read(s, counts);
+        for(size_t i = 0; i < counts.size(); i += 2)
+            model.Add(counts[i], counts[i+1]);
+    }
+
+    public:
+    struct Info {
+        uint64_t iteration; // number of completed iterations
+        float alpha_prefix, alpha_stem, alpha_suffix;
+        uint32_t max_prefix, max_stem, max_suffix, min_affix_types; // morphemes.h
+        uint32_t pad;
+    };
+
+    /* Write the state of the sampler after `info.iteration` iterations to `path`;
+     * the model must be synchronized */
+    static void Save(const std::string& path, const Info& info,
+            const Vocabulary& word_vocabulary,
+            const SubstringVocabulary& substring_vocabulary,
+            const SubstringTable& substrings,
+            const std::vector<unsigned>& tokens,
+            const SegmentationStore& segs,
+            const SegmentationModel& model,
+            const std::vector<std::mt19937>& engines) {
+        const std::string tmp_path = path + ".tmp";
+        std::ofstream out(tmp_path, std::ios::binary);
+        Header header;
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, "UMORPHCK", 8);
+        header.version = version;
+        header.n_sections = N_SECTIONS;
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+        Write(out, header, INFO, &info, 1);
+
+        std::vector<char> words;
+        std::vector<uint64_t> word_offsets(1, 0);
+        for(const std::string& word: word_vocabulary) {
+            words.insert(words.end(), word.begin(), word.end());
+            word_offsets.push_back(words.size());
+        }
+        Write(out, header, WORDS, words);
+        Write(out, header, WORD_OFFSETS, word_offsets);
+
+        Write(out, header, SUBSTRINGS, substring_vocabulary.arena);
+        Write(out, header, SUBSTRING_OFFSETS, substring_vocabulary.offsets);
+        Write(out, header, SUBSTRING_HASHES, substring_vocabulary.hashes);
+        Write(out, header, SUBSTRING_SLOTS, substring_vocabulary.table);
+
+        Write(out, header, TABLE_OFFSETS, substrings.offsets);
+        Write(out, header, TABLE_LENGTHS, substrings.lengths);
+        Write(out, header, TABLE_IDS, substrings.arena);
+        Write(out, header, TABLE_CHAR_OFFSETS, substrings.char_offsets);
+        Write(out, header, TABLE_LABELS, substrings.labels);
+        Write(out, header, TABLE_BOUNDS, substrings.bounds);
+
+        // Segmentation i is [#prefixes, prefixes..., stem, suffixes...]
+        std::vector<uint64_t> segment_offsets(1, 0);
+        std::vector<uint32_t> segments;
+        Segmentation seg;
+        for(size_t i = 0; i < segs.Size(); i++) {
+            segs.Get(i, seg);
+            segments.push_back(seg.prefixes.size());
+            segments.insert(segments.end(), seg.prefixes.begin(), seg.prefixes.end());
+            segments.push_back(seg.stem);
+            segments.insert(segments.end(), seg.suffixes.begin(), seg.suffixes.end());
+            segment_offsets.push_back(segments.size());
+        }
+        Write(out, header, TOKENS, tokens);
+        Write(out, header, SEGMENT_OFFSETS, segment_offsets);
+        Write(out, header, SEGMENTS, segments);
+
+        Write(out, header, PREFIX_COUNTS, Counts(model.prefix_model));
+        Write(out, header, STEM_COUNTS, Counts(model.stem_model));
+        Write(out, header, SUFFIX_COUNTS, Counts(model.suffix_model));
+        const uint32_t length_counts[4] = {
+            model.prefix_length_model.L, model.prefix_length_model.N,
+            model.suffix_length_model.L, model.suffix_length_model.N };
+        Write(out, header, LENGTH_COUNTS, length_counts, 4);
+
+        std::ostringstream states;
+        for(const std::mt19937& engine: engines)
+            states << engine << "\n";
+        const std::string state = states.str();
+        Write(out, header, ENGINES, state.data(), state.size());
+
+        out.seekp(0);
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.close();
+        if(!out || rename(tmp_path.c_str(), path.c_str()) != 0) {
+            std::cerr << "Could not write checkpoint `" << path << "`\n";
+            exit(1);
+        }
+    }
+
+    /* Map the checkpoint at `path` */
+    Checkpoint(const std::string& path) : data(nullptr), length(0), header(nullptr) {
+        const int fd = open(path.c_str(), O_RDONLY);
+        struct stat st;
+        if(fd < 0 || fstat(fd, &st) != 0) {
+            std::cerr << "Could not open checkpoint `" << path << "`\n";
+            exit(1);
+        }
+        length = st.st_size;
+        void* mapped = (length >= sizeof(Header))
+            ? mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+        close(fd);
+        if(mapped == MAP_FAILED) {
+            std::cerr << "Could not map checkpoint `" << path << "`\n";
+            exit(1);
+        }
+        data = static_cast<const char*>(mapped);
+        header = reinterpret_cast<const Header*>(data);
+        bool valid = memcmp(header->magic, "UMORPHCK", 8) == 0
+            && header->version == version && header->n_sections == N_SECTIONS;
+        for(unsigned s = 0; valid && s < N_SECTIONS; s++)
+            valid = header->offset[s] + header->size[s] <= length;
+        if(!valid) {
+            std::cerr << "Invalid checkpoint `" << path << "`\n";
+            exit(1);
+        }
+    }
+
+    ~Checkpoint() {
+        munmap(const_cast<char*>(data), length);
+    }
+
+    const Info& GetInfo() const {
+        return *reinterpret_cast<const Info*>(data + header->offset[INFO]);
+    }
+
+    /* Restore the vocabularies and the substring table, which are needed
+     * to construct the model */
+    void LoadVocabularies(Vocabulary& word_vocabulary,
+            SubstringVocabulary& substring_vocabulary,
+            SubstringTable& substrings) const {
+        std::vector<char> words;
+        std::vector<uint64_t> word_offsets;
+        Read(WORDS, words);
+        Read(WORD_OFFSETS, word_offsets);
+        for(size_t w = 0; w + 1 < word_offsets.size(); w++)
+            word_vocabulary.Encode(std::string(words.begin() + word_offsets[w],
+                        words.begin() + word_offsets[w+1]));
+
+        Read(SUBSTRINGS, substring_vocabulary.arena);
+        Read(SUBSTRING_OFFSETS, substring_vocabulary.offsets);
+        Read(SUBSTRING_HASHES, substring_vocabulary.hashes);
+        Read(SUBSTRING_SLOTS, substring_vocabulary.table);
+
+        Read(TABLE_OFFSETS, substrings.offsets);
+        Read(TABLE_LENGTHS, substrings.lengths);
+        Read(TABLE_IDS, substrings.arena);
+        Read(TABLE_CHAR_OFFSETS, substrings.char_offsets);
+        Read(TABLE_LABELS, substrings.labels);
+        Read(TABLE_BOUNDS, substrings.bounds);
+    }
+
+    /* Restore the model counts; the model must be empty */
+    void LoadModel(SegmentationModel& model) const {
+        ReadCounts(PREFIX_COUNTS, model.prefix_model);
+        ReadCounts(STEM_COUNTS, model.stem_model);
+        ReadCounts(SUFFIX_COUNTS, model.suffix_model);
+        std::vector<uint32_t> length_counts;
+        Read(LENGTH_COUNTS, length_counts);
+        model.prefix_length_model.Add(length_counts[0], length_counts[1]);
+        model.suffix_length_model.Add(length_counts[2], length_counts[3]);
+        model.Synchronize();
+    }
+
+    void LoadTokens(std::vector<unsigned>& tokens) const {
+        Read(TOKENS, tokens);
+    }
+
+    /* Restore the segmentations of the saved tokens (the first ones of
+     * `segs`), the model counts (the model must be empty) and as many random
+     * engines as were saved */
+    void LoadState(SegmentationStore& segs, SegmentationModel& model,
+            std::vector<std::mt19937>& engines) const {
+        std::vector<uint64_t> segment_offsets;
+        std::vector<uint32_t> segments;
+        Read(SEGMENT_OFFSETS, segment_offsets);
+        Read(SEGMENTS, segments);
+        assert(segment_offsets.size() - 1 <= segs.Size());
+        Segmentation seg;
+        for(size_t i = 0; i + 1 < segment_offsets.size(); i++) {
+            const uint32_t* s = &segments[segment_offsets[i]];
+            const uint32_t* end = &segments[0] + segment_offsets[i+1];
+            const unsigned n_prefixes = *s++;
+            seg.prefixes.assign(s, s + n_prefixes);
+            s += n_prefixes;
+            seg.stem = *s++;
+            seg.suffixes.assign(s, end);
+            segs.Set(i, seg);
+        }
+
+        LoadModel(model);
+
+        std::istringstream states(std::string(data + header->offset[ENGINES],
+                    header->size[ENGINES]));
+        for(unsigned k = 0; k < engines.size() && states >> engines[k]; k++);
+    }
+};
@@ -1,42 +1,214 @@
 #include <string>
 #include <vector>
 #include <iostream>
-#include <sstream>
+#include <algorithm>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/* A tokenized corpus: one sentence per line, tokens separated by whitespace
+ * Tokens are stored in one flat array with sentence offsets. Input is split
+ * into chunks on line boundaries which are tokenized in parallel, each with
+ * its own vocabulary; chunk vocabularies are then merged in order, so word
+ * ids are the same as with a sequential pass (order of first occurrence). */
 
 class Corpus {
-    std::vector< std::vector<unsigned> > segments;
-    typedef std::vector< std::vector<unsigned> >::const_iterator const_iterator;
-    
+    std::vector<unsigned> tokens;
+    std::vector<size_t> offsets; // sentence k is tokens[offsets[k]:offsets[k+1]]
+
+    static bool IsSpace(char c) {
+        return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+    }
+
+    struct Chunk {
+        SubstringVocabulary vocabulary;
+        std::vector<unsigned> tokens;
+        std::vector<unsigned> lengths; // number of tokens of each sentence
+    };
+
+    static void Tokenize(const char* data, const char* end, Chunk& chunk) {
+        while(data < end) {
+            const char* eol = static_cast<const char*>(memchr(data, '\n', end - data));
+            if(eol == nullptr) eol = end;
+            unsigned n = 0;
+            while(data < eol) {
+                while(data < eol && IsSpace(*data)) data++;
+                const char* word = data;
+                while(data < eol && !IsSpace(*data)) data++;
+                if(data > word) {
+                    chunk.tokens.push_back(chunk.vocabulary.Encode(word, data - word));
+                    n++;
+                }
+            }
+            chunk.lengths.push_back(n);
+            data = eol + 1;
+        }
+    }
+
+    /* Tokenize `size` bytes of whole lines and append their sentences */
+    void Load(const char* data, size_t size, Vocabulary& vocabulary, ThreadPool* pool) {
+        if(size == 0) return;
+        // Chunk boundaries: just after a newline
+        const unsigned n_chunks = pool ? 4 * pool->size() : 1;
+        std::vector<const char*> bounds(1, data);
+        for(unsigned c = 1; c < n_chunks; c++) {
+            const char* p = std::max(bounds.back(), data + size * c / n_chunks);
+            const char* eol = static_cast<const char*>(memchr(p, '\n', data + size - p));
+            if(eol == nullptr) break;
+            if(eol + 1 > bounds.back()) bounds.push_back(eol + 1);
+        }
+        bounds.push_back(data + size);
+
+        std::vector<Chunk> chunks(bounds.size() - 1);
+        auto tokenize = [&] (size_t c, unsigned thread) {
+            Tokenize(bounds[c], bounds[c+1], chunks[c]);
+        };
+        if(pool) {
+            pool->enqueue_range(0, chunks.size(), tokenize, 1);
+            pool->wait();
+        }
+        else
+            tokenize(0, 0);
+
+        // Merge chunk vocabularies in order, then renumber chunk tokens
+        std::vector< std::vector<unsigned> > ids(chunks.size());
+        std::vector<size_t> token_start(chunks.size() + 1, tokens.size()); // appended
+        for(unsigned c = 0; c < chunks.size(); c++) {
+            ids[c].resize(chunks[c].vocabulary.Size());
+            for(unsigned k = 0; k < ids[c].size(); k++)
+                ids[c][k] = vocabulary.Encode(chunks[c].vocabulary.Convert(k));
+            chunks[c].vocabulary = SubstringVocabulary();
+            for(unsigned n: chunks[c].lengths)
+                offsets.push_back(offsets.back() + n);
+            token_start[c+1] = token_start[c] + chunks[c].tokens.size();
+        }
+        tokens.resize(token_start.back());
+        auto renumber = [&] (size_t c, unsigned thread) {
+            for(size_t i = 0; i < chunks[c].tokens.size(); i++)
+                tokens[token_start[c] + i] = ids[c][chunks[c].tokens[i]];
+        };
+        if(pool) {
+            pool->enqueue_range(0, chunks.size(), renumber, 1);
+            pool->wait();
+        }
+        else
+            renumber(0, 0);
+    }
+
     public:
-    Corpus(std::istream& input_stream, Vocabulary& vocabulary): segments() {
-        std::string line, word;
-        while(getline(input_stream, line)) {
-            std::vector<unsigned> segment;
-            std::stringstream sstr(line);
-            while(sstr >> word) {
-                segment.push_back(vocabulary.Encode(word));
+    /* Tokens of one sentence */
+    class Sentence {
+        const unsigned *first, *last;
+        public:
+        Sentence(const unsigned* first, const unsigned* last) : first(first), last(last) {}
+        const unsigned* begin() const { return first; }
+        const unsigned* end() const { return last; }
+        size_t size() const { return last - first; }
+    };
+
+    class const_iterator {
+        const Corpus* corpus;
+        size_t k;
+        Sentence sentence;
+        public:
+        const_iterator(const Corpus* corpus, size_t k) : corpus(corpus), k(k),
+            sentence(nullptr, nullptr) {}
+        const Sentence& operator*() {
+            sentence = corpus->Get(k);
+            return sentence;
+        }
+        const_iterator& operator++() {
+            k++;
+            return *this;
+        }
+        bool operator!=(const const_iterator& other) const {
+            return k != other.k;
+        }
+    };
+
+    /* Read `input` in large blocks and tokenize them sequentially */
+    Corpus(std::istream& input_stream, Vocabulary& vocabulary) : tokens(), offsets(1, 0) {
+        Stream(input_stream, vocabulary, nullptr);
+    }
+
+    /* Tokenize the file at `path` (standard input if empty) with `pool`;
+     * files are memory-mapped, standard input is read in large blocks, each
+     * tokenized in parallel as soon as it is read */
+    Corpus(const std::string& path, Vocabulary& vocabulary, ThreadPool& pool)
+        : tokens(), offsets(1, 0) {
+        if(path.empty()) {
+            Stream(std::cin, vocabulary, &pool);
+            return;
+        }
+        const int fd = open(path.c_str(), O_RDONLY);
+        struct stat st;
+        if(fd < 0 || fstat(fd, &st) != 0) {
+            std::cerr << "Could not open corpus `" << path << "`\n";
+            exit(1);
+        }
+        if(st.st_size == 0) { // empty corpus: nothing to map
+            close(fd);
+            return;
+        }
+        void* mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if(mapped == MAP_FAILED) {
+            std::cerr << "Could not map corpus `" << path << "`\n";
+            exit(1);
+        }
+        madvise(mapped, st.st_size, MADV_SEQUENTIAL);
+        Load(static_cast<const char*>(mapped), st.st_size, vocabulary, &pool);
+        munmap(mapped, st.st_size);
+    }
+
+    /* Tokenize `input` block by block: each block is cut after its last
+     * newline and the partial line is carried over to the next one, so only
+     * a block of text is held in memory at a time */
+    void Stream(std::istream& input_stream, Vocabulary& vocabulary, ThreadPool* pool) {
+        const size_t block_size = 1 << 26;
+        std::vector<char> block;
+        size_t carry = 0; // bytes of an unfinished line at the start of the block
+        while(true) {
+            block.resize(std::max(block_size, 2 * carry));
+            input_stream.read(block.data() + carry, block.size() - carry);
+            const size_t size = carry + input_stream.gcount();
+            if(input_stream.gcount() == 0) {
+                Load(block.data(), size, vocabulary, pool); // last line, if unfinished
+                return;
             }
-            segments.push_back(segment);
+            const char* end = block.data() + size;
+            while(end > block.data() && end[-1] != '\n') end--;
+            const size_t lines = end - block.data();
+            Load(block.data(), lines, vocabulary, pool);
+            carry = size - lines;
+            std::copy(block.begin() + lines, block.begin() + size, block.begin());
         }
     }
 
+    Sentence Get(size_t k) const {
+        return Sentence(tokens.data() + offsets[k], tokens.data() + offsets[k+1]);
+    }
+
+    /* All the tokens of the corpus, sentence after sentence */
+    const std::vector<unsigned>& TokenIds() const {
+        return tokens;
+    }
+
     size_t Size() const {
-        return segments.size();
+        return offsets.size() - 1;
     }
 
     size_t Tokens() const {
-        size_t N = 0;
-        for(auto& doc: segments) {
-            N += doc.size();
-        }
-        return N;
+        return tokens.size();
     }
 
     const_iterator begin() const {
-        return segments.begin(); 
+        return const_iterator(this, 0);
     }
 
     const_iterator end() const {
-        return segments.end(); 
+        return const_iterator(this, Size());
     }
 };
@@ -0,0 +1,450 @@
+#include <vector>
+#include <string>
+#include <memory>
+#include <iostream>
+#include <algorithm>
+#include <utility>
+#include <thread>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+
+/* Multi-process sampling: a coordinator and workers exchanging count deltas
+ * The coordinator reads the corpus, sends every worker the word types and a
+ * shard of the tokens, and keeps the global model. Workers build the same
+ * substring table, sample their shard with the usual parallel loop against
+ * their own copy of the counts, and at the end of each iteration send the
+ * sparse changes of their counts; the coordinator adds them up and returns
+ * to each worker the changes of all the others, after which every copy of
+ * the model holds the global counts again. Within an iteration a worker does
+ * not see the changes of the other shards, as with --stale-counts.
+ * Messages are sent in host byte order, so all processes must run on
+ * machines of the same architecture. */
+
+/* A connected stream socket, over TCP ("host:port") or a Unix domain socket
+ * ("unix:path") */
+
+class Channel {
+    int fd;
+
+    /* Socket address of `address`, as resolved by getaddrinfo for TCP */
+    static addrinfo* Resolve(const std::string& address, bool passive) {
+        const size_t colon = address.rfind(':');
+        if(colon == std::string::npos) {
+            std::cerr << "Invalid address `" << address << "` (host:port or unix:path)\n";
+            exit(1);
+        }
+        const std::string host = address.substr(0, colon), port = address.substr(colon + 1);
+        addrinfo hints, *result = nullptr;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        if(passive) hints.ai_flags = AI_PASSIVE;
+        const bool any = host.empty() || host == "*";
+        if(getaddrinfo(any ? nullptr : host.c_str(), port.c_str(), &hints, &result) != 0) {
+            std::cerr << "Could not resolve `" << address << "`\n";
+            exit(1);
+        }
+        return result;
+    }
+
+    static bool IsUnix(const std::string& address, sockaddr_un& unix_address) {
+        if(address.compare(0, 5, "unix:") != 0) return false;
+        const std::string path = address.substr(5);
+        memset(&unix_address, 0, sizeof(unix_address));
+        unix_address.sun_family = AF_UNIX;
+        if(path.empty() || path.size() >= sizeof(unix_address.sun_path)) {
+            std::cerr << "Invalid socket path `" << path << "`\n";
+            exit(1);
+        }
+        strcpy(unix_address.sun_path, path.c_str());
+        return true;
+    }
+
+    static void NoDelay(int fd) {
+        const int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+
+    public:
+    explicit Channel(int fd) : fd(fd) {}
+
+    Channel(const Channel&) = delete;
+    Channel& operator=(const Channel&) = delete;
+
+    ~Channel() {
+        if(fd >= 0) close(fd);
+    }
+
+    /* Listening socket at `address` */
+    static int Listen(const std::string& address) {
+        sockaddr_un unix_address;
+        if(IsUnix(address, unix_address)) {
+            unlink(unix_address.sun_path);
+            const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            if(fd < 0 || bind(fd, (sockaddr*) &unix_address, sizeof(unix_address)) != 0
+                    || listen(fd, SOMAXCONN) != 0) {
+                std::cerr << "Could not listen at `" << address << "`: " << strerror(errno) << "\n";
+                exit(1);
+            }
+            return fd;
+        }
+        addrinfo* result = Resolve(address, true);
+        int fd = -1;
+        for(addrinfo* a = result; a && fd < 0; a = a->ai_next) {
+            fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+            if(fd < 0) continue;
+            const int one = 1;
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            if(bind(fd, a->ai_addr, a->ai_addrlen) != 0 || listen(fd, SOMAXCONN) != 0) {
+                close(fd);
+                fd = -1;
+            }
+        }
+        freeaddrinfo(result);
+        if(fd < 0) {
+            std::cerr << "Could not listen at `" << address << "`\n";
+            exit(1);
+        }
+        return fd;
+    }
+
+    /* Wait for the next connection on listening socket `listener` */
+    static std::unique_ptr<Channel> Accept(int listener) {
+        const int fd = accept(listener, nullptr, nullptr);
+        if(fd < 0) {
+            std::cerr << "Could not accept a connection: " << strerror(errno) << "\n";
+            exit(1);
+        }
+        NoDelay(fd);
+        return std::unique_ptr<Channel>(new Channel(fd));
+    }
+
+    /* Connect to `address`, retrying for `timeout` seconds so that workers
+     * can be started before the coordinator */
+    static std::unique_ptr<Channel> Connect(const std::string& address, double timeout=30) {
+        const auto deadline = std::chrono::steady_clock::now()
+            + std::chrono::milliseconds((long) (timeout * 1000));
+        sockaddr_un unix_address;
+        const bool unix_socket = IsUnix(address, unix_address);
+        while(true) {
+            int fd = -1;
+            if(unix_socket) {
+                fd = socket(AF_UNIX, SOCK_STREAM, 0);
+                if(fd >= 0 && connect(fd, (sockaddr*) &unix_address, sizeof(unix_address)) != 0) {
+                    close(fd);
+                    fd = -1;
+                }
+            }
+            else {
+                addrinfo* result = Resolve(address, false);
+                for(addrinfo* a = result; a && fd < 0; a = a->ai_next) {
+                    fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+                    if(fd >= 0 && connect(fd, a->ai_addr, a->ai_addrlen) != 0) {
+                        close(fd);
+                        fd = -1;
+                    }
+                }
+                freeaddrinfo(result);
+                if(fd >= 0) NoDelay(fd);
+            }
+            if(fd >= 0)
+                return std::unique_ptr<Channel>(new Channel(fd));
+            if(std::chrono::steady_clock::now() > deadline) {
+                std::cerr << "Could not connect to `" << address << "`\n";
+                exit(1);
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+    }
+
+    void SendBytes(const void* data, size_t n) {
+        const char* p = static_cast<const char*>(data);
+        while(n > 0) {
+            const ssize_t sent = send(fd, p, n, MSG_NOSIGNAL);
+            if(sent < 0 && errno == EINTR) continue;
+            if(sent <= 0) {
+                std::cerr << "Connection lost: " << strerror(errno) << "\n";
+                exit(1);
+            }
+            p += sent;
+            n -= sent;
+        }
+    }
+
+    void ReceiveBytes(void* data, size_t n) {
+        char* p = static_cast<char*>(data);
+        while(n > 0) {
+            const ssize_t received = recv(fd, p, n, 0);
+            if(received < 0 && errno == EINTR) continue;
+            if(received <= 0) {
+                std::cerr << "Connection lost" << (received < 0 ? ": " : "")
+                    << (received < 0 ? strerror(errno) : "") << "\n";
+                exit(1);
+            }
+            p += received;
+            n -= received;
+        }
+    }
+
+    /* Plain values, and arrays of them prefixed by their size */
+    template <typename T>
+    void Send(const T& value) {
+        SendBytes(&value, sizeof(T));
+    }
+
+    template <typename T>
+    T Receive() {
+        T value;
+        ReceiveBytes(&value, sizeof(T));
+        return value;
+    }
+
+    template <typename T>
+    void SendVector(const std::vector<T>& values) {
+        Send<uint64_t>(values.size());
+        SendBytes(values.data(), values.size() * sizeof(T));
+    }
+
+    template <typename T>
+    void ReceiveVector(std::vector<T>& values) {
+        values.resize(Receive<uint64_t>());
+        ReceiveBytes(values.data(), values.size() * sizeof(T));
+    }
+};
+
+/* Sparse changes of the counts of a SegmentationModel
+ * Morpheme counts are (id, change) pairs sorted by id, so that deltas are
+ * added by merging; the absolute counts of a model are its delta from an
+ * empty model. */
+
+struct CountDelta {
+    typedef std::vector< std::pair<uint32_t, int32_t> > Counts;
+
+    Counts morphemes[3]; // by Part
+    int64_t lengths[4]; // L and N of the prefix, then suffix length models
+
+    CountDelta() {
+        std::fill(lengths, lengths + 4, 0);
+    }
+
+    /* Current counts of `model`; must not run concurrently with updates */
+    explicit CountDelta(const SegmentationModel& model) {
+        const DirichletMultinomial* models[3] = {
+            &model.prefix_model, &model.stem_model, &model.suffix_model };
+        for(unsigned part = 0; part < 3; part++) {
+            Counts& counts = morphemes[part];
+            models[part]->ForEach([&counts] (unsigned k, unsigned c) {
+                counts.emplace_back(k, c);
+            });
+            std::sort(counts.begin(), counts.end());
+        }
+        lengths[0] = model.prefix_length_model.L;
+        lengths[1] = model.prefix_length_model.N;
+        lengths[2] = model.suffix_length_model.L;
+        lengths[3] = model.suffix_length_model.N;
+    }
+
+    /* this += sign * other */
+    void Add(const CountDelta& other, int sign=1) {
+        for(unsigned part = 0; part < 3; part++) {
+            const Counts& a = morphemes[part];
+            const Counts& b = other.morphemes[part];
+            Counts sum;
+            sum.reserve(a.size() + b.size());
+            size_t i = 0, j = 0;
+            while(i < a.size() || j < b.size()) {
+                if(j == b.size() || (i < a.size() && a[i].first < b[j].first))
+                    sum.push_back(a[i++]);
+                else if(i == a.size() || b[j].first < a[i].first) {
+                    sum.emplace_back(b[j].first, sign * b[j].second);
+                    j++;
+                }
+                else {
+                    const int32_t n = a[i].second + sign * b[j].second;
+                    if(n != 0) sum.emplace_back(a[i].first, n);
+                    i++;
+                    j++;
+                }
+            }
+            morphemes[part].swap(sum);
+        }
+        for(unsigned k = 0; k < 4; k++)
+            lengths[k] += sign * other.lengths[k];
+    }
+
+    /* Add the changes to the counts of `model` */
+    void Apply(SegmentationModel& model) const {
+        DirichletMultinomial* models[3] = {
+            &model.prefix_model, &model.stem_model, &model.suffix_model };
+        for(unsigned part = 0; part < 3; part++)
+            for(auto& kn: morphemes[part])
+                models[part]->Add(kn.first, kn.second);
+        model.prefix_length_model.Add(lengths[0], lengths[1]);
+        model.suffix_length_model.Add(lengths[2], lengths[3]);
+    }
+
+    void Send(Channel& channel) const {
+        for(unsigned part = 0; part < 3; part++)
+            channel.SendVector(morphemes[part]);
+        channel.SendBytes(lengths, sizeof(lengths));
+    }
+
+    void Receive(Channel& channel) {
+        for(unsigned part = 0; part < 3; part++)
+            channel.ReceiveVector(morphemes[part]);
+        channel.ReceiveBytes(lengths, sizeof(lengths));
+    }
+};
+
+/* Hash of the substring ids of every word type, to check that the
+ * coordinator and the workers number substrings identically */
+inline uint64_t Fingerprint(const SubstringTable& substrings) {
+    uint64_t h = 14695981039346656037ull; // FNV-1a over the ids
+    for(unsigned w = 0; w < substrings.Size(); w++) {
+        const unsigned L = substrings.Length(w);
+        const int* ids = substrings.Ids(w);
+        for(unsigned s = 0; s < L * (L + 1) / 2; s++)
+            h = (h ^ (uint32_t) ids[s]) * 1099511628211ull;
+    }
+    return h;
+}
+
+/* Instruction sent by the coordinator at the start of each iteration */
+struct Command {
+    uint32_t stop; // no more iterations: the worker exits
+    uint32_t iteration;
+    double temperature;
+};
+
+/* Coordinator end: one channel per worker, in order of connection */
+
+class ShardCoordinator {
+    std::vector< std::unique_ptr<Channel> > workers;
+    std::vector<CountDelta> deltas; // last changes received from each worker
+
+    public:
+    /* Wait for `n_workers` workers to connect at `address` */
+    ShardCoordinator(const std::string& address, unsigned n_workers) : workers(), deltas(n_workers) {
+        const int listener = Channel::Listen(address);
+        for(unsigned k = 0; k < n_workers; k++)
+            workers.push_back(Channel::Accept(listener));
+        close(listener);
+        if(address.compare(0, 5, "unix:") == 0)
+            unlink(address.c_str() + 5);
+    }
+
+    size_t Size() const {
+        return workers.size();
+    }
+
+    /* Send every worker the sampler settings, the word types and a contiguous
+     * shard of `tokens`, and check that they number substrings as we do */
+    void SendShards(const Checkpoint::Info& info, const Vocabulary& word_vocabulary,
+            const std::vector<unsigned>& tokens, const SubstringTable& substrings,
+            unsigned n_substrings) {
+        std::vector<char> words;
+        std::vector<uint64_t> word_offsets(1, 0);
+        for(const std::string& word: word_vocabulary) {
+            words.insert(words.end(), word.begin(), word.end());
+            word_offsets.push_back(words.size());
+        }
+        const size_t n = workers.size();
+        for(size_t k = 0; k < n; k++) {
+            Channel& worker = *workers[k];
+            worker.Send(info);
+            worker.SendVector(words);
+            worker.SendVector(word_offsets);
+            const std::vector<unsigned> shard(tokens.begin() + tokens.size() * k / n,
+                    tokens.begin() + tokens.size() * (k+1) / n);
+            worker.SendVector(shard);
+        }
+        const uint64_t fingerprint = Fingerprint(substrings);
+        for(size_t k = 0; k < n; k++)
+            if(workers[k]->Receive<uint64_t>() != n_substrings
+                    || workers[k]->Receive<uint64_t>() != fingerprint) {
+                std::cerr << "Worker " << k << " built a different substring table\n";
+                exit(1);
+            }
+    }
+
+    void Broadcast(const Command& command) {
+        for(auto& worker: workers)
+            worker->Send(command);
+    }
+
+    /* Gather the changes of every worker since the last exchange, add them to
+     * `model` and send each worker the changes of all the others;
+     * returns the total number of segmentations the workers changed */
+    size_t Exchange(SegmentationModel& model) {
+        size_t n_changed = 0;
+        CountDelta total;
+        for(size_t k = 0; k < workers.size(); k++) {
+            deltas[k].Receive(*workers[k]);
+            n_changed += workers[k]->Receive<uint64_t>();
+            total.Add(deltas[k]);
+        }
+        for(size_t k = 0; k < workers.size(); k++) {
+            CountDelta others = total;
+            others.Add(deltas[k], -1);
+            others.Send(*workers[k]);
+        }
+        total.Apply(model);
+        model.Synchronize();
+        return n_changed;
+    }
+};
+
+/* Worker end */
+
+class ShardWorker {
+    std::unique_ptr<Channel> coordinator;
+
+    public:
+    ShardWorker(const std::string& address) : coordinator(Channel::Connect(address)) {}
+
+    /* Receive the sampler settings, the word types and the tokens of this
+     * worker's shard */
+    Checkpoint::Info ReceiveShard(Vocabulary& word_vocabulary, std::vector<unsigned>& tokens) {
+        const Checkpoint::Info info = coordinator->Receive<Checkpoint::Info>();
+        std::vector<char> words;
+        std::vector<uint64_t> word_offsets;
+        coordinator->ReceiveVector(words);
+        coordinator->ReceiveVector(word_offsets);
+        for(size_t w = 0; w + 1 < word_offsets.size(); w++)
+            word_vocabulary.Encode(std::string(words.data() + word_offsets[w],
+                        word_offsets[w+1] - word_offsets[w]));
+        coordinator->ReceiveVector(tokens);
+        return info;
+    }
+
+    void SendSubstrings(const SubstringTable& substrings, unsigned n_substrings) {
+        coordinator->Send<uint64_t>(n_substrings);
+        coordinator->Send<uint64_t>(Fingerprint(substrings));
+    }
+
+    Command ReceiveCommand() {
+        return coordinator->Receive<Command>();
+    }
+
+    /* Send the changes of `model` since it held the counts `before`, with the
+     * number of segmentations changed, then add the changes of the other
+     * workers: `model` then holds the global counts */
+    void Exchange(SegmentationModel& model, const CountDelta& before, size_t n_changed) {
+        CountDelta delta(model);
+        delta.Add(before, -1);
+        delta.Send(*coordinator);
+        coordinator->Send<uint64_t>(n_changed);
+        CountDelta others;
+        others.Receive(*coordinator);
+        others.Apply(model);
+        model.Synchronize();
+    }
+};
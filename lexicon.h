@@ -0,0 +1,97 @@
+#include <string>
+#include <random>
+
+/* A two-part segmentation model: each word is split into a prefix
+ * and a suffix drawn from Dirichlet-multinomial distributions
+ * The prefix and suffix ids of every split of every word type are looked up
+ * once, at construction, into a flat array: sampling and decoding only read
+ * ids and counts, and never allocate. Increment draws from a scratch buffer
+ * owned by the model, so it is not re-entrant: unlike the counts, which are
+ * thread-safe, concurrent samplers need one LexiconModel each. */
+
+class LexiconModel {
+    public:
+    LexiconModel(float alpha_t, float alpha_f,
+            const Vocabulary& word_vocabulary,
+            const Vocabulary& prefix_vocabulary,
+            const Vocabulary& suffix_vocabulary) :
+        prefix_model(prefix_vocabulary.Size(), alpha_t),
+        suffix_model(suffix_vocabulary.Size(), alpha_f),
+        offsets(1, 0), ids(), cumulative() {
+        size_t max_splits = 0;
+        for(const std::string& word: word_vocabulary) {
+            for(unsigned split = 0; split <= word.size(); split++) {
+                ids.push_back(prefix_vocabulary.Convert(word.substr(0, split)));
+                ids.push_back(suffix_vocabulary.Convert(word.substr(split)));
+            }
+            offsets.push_back(ids.size());
+            max_splits = std::max(max_splits, word.size() + 1);
+        }
+        cumulative.resize(max_splits);
+    }
+
+    unsigned Increment(unsigned w, std::mt19937& engine, bool initialize=false) {
+        const unsigned n = Splits(w);
+        const unsigned* tf = &ids[offsets[w]];
+        unsigned split;
+        if(initialize)
+            split = prob::randint(engine, 0, n - 1);
+        else {
+            // One pass for the cumulative weights of the splits, then a draw
+            float total = 0;
+            for(unsigned s = 0; s < n; s++)
+                cumulative[s] = (total += prefix_model.Prob(tf[2*s]) * suffix_model.Prob(tf[2*s+1]));
+            const float x = prob::random(engine) * total;
+            split = std::upper_bound(cumulative.begin(), cumulative.begin() + n - 1, x)
+                - cumulative.begin();
+        }
+        prefix_model.Increment(tf[2*split]);
+        suffix_model.Increment(tf[2*split+1]);
+        return split;
+    }
+
+    void Decrement(unsigned w, unsigned split) {
+        const unsigned* tf = &ids[offsets[w] + 2*split];
+        prefix_model.Decrement(tf[0]);
+        suffix_model.Decrement(tf[1]);
+    }
+
+    float Prob(unsigned w) const {
+        const unsigned n = Splits(w);
+        const unsigned* tf = &ids[offsets[w]];
+        float prob = 0;
+        for(unsigned s = 0; s < n; s++)
+            prob += prefix_model.Prob(tf[2*s]) * suffix_model.Prob(tf[2*s+1]);
+        return prob;
+    }
+
+    unsigned Decode(unsigned w) const {
+        const unsigned n = Splits(w);
+        const unsigned* tf = &ids[offsets[w]];
+        float max_prob = -1;
+        unsigned best_split = 0;
+        for(unsigned s = 0; s < n; s++) {
+            const float prob = prefix_model.Prob(tf[2*s]) * suffix_model.Prob(tf[2*s+1]);
+            if(prob >= max_prob) {
+                max_prob = prob;
+                best_split = s;
+            }
+        }
+        return best_split;
+    }
+
+    double LogLikelihood() const {
+        return prefix_model.LogLikelihood() + suffix_model.LogLikelihood();
+    }
+
+    private:
+    /* Number of splits of word type `w`: its length in bytes plus one */
+    unsigned Splits(unsigned w) const {
+        return (offsets[w+1] - offsets[w]) / 2;
+    }
+
+    DirichletMultinomial prefix_model, suffix_model;
+    std::vector<size_t> offsets; // splits of word w are ids[offsets[w]:offsets[w+1]]
+    std::vector<unsigned> ids; // prefix id, suffix id for each split
+    std::vector<float> cumulative; // scratch space of Increment (not thread-safe)
+};
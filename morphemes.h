@@ -0,0 +1,74 @@
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+
+/* Constraints on the morphemes of a segmentation
+ * Prefixes, stems and suffixes can be capped in length (in characters), and
+ * affixes can be restricted to substrings found in at least a minimum number
+ * of word types. Lattices (banana.h, chart.h) only contain allowed morphemes,
+ * and substrings longer than every cap are not even given an id in the
+ * substring table. The whole word is always allowed as a stem, so that every
+ * word keeps at least one segmentation. */
+
+enum Part { PREFIX, STEM, SUFFIX };
+
+class MorphemeFilter {
+    unsigned max_length[3]; // by part, 0 for no limit
+    unsigned min_affix_types;
+    std::vector<uint8_t> affix; // by substring id: frequent enough to be an affix
+
+    public:
+    MorphemeFilter(unsigned max_prefix=0, unsigned max_stem=0, unsigned max_suffix=0,
+            unsigned min_affix_types=0) : min_affix_types(min_affix_types), affix() {
+        max_length[PREFIX] = max_prefix;
+        max_length[STEM] = max_stem;
+        max_length[SUFFIX] = max_suffix;
+    }
+
+    unsigned MaxPrefix() const { return max_length[PREFIX]; }
+    unsigned MaxStem() const { return max_length[STEM]; }
+    unsigned MaxSuffix() const { return max_length[SUFFIX]; }
+    unsigned MinAffixTypes() const { return min_affix_types; }
+
+    /* Longest `part` morpheme of a word of length L */
+    unsigned MaxLength(Part part, unsigned L) const {
+        return (max_length[part] == 0) ? L : std::min(L, max_length[part]);
+    }
+
+    /* Longest substring that can be a morpheme, 0 for no limit */
+    unsigned MaxSubstringLength() const {
+        if(max_length[PREFIX] == 0 || max_length[STEM] == 0 || max_length[SUFFIX] == 0)
+            return 0;
+        return std::max(max_length[PREFIX], std::max(max_length[STEM], max_length[SUFFIX]));
+    }
+
+    /* Count the word types containing each substring and keep the affix
+     * candidates found in at least `min_affix_types` of them */
+    void PruneAffixes(const SubstringTable& substrings, unsigned n_substrings) {
+        affix.clear();
+        if(min_affix_types <= 1) return;
+        std::vector<unsigned> types(n_substrings, 0), last(n_substrings, -1);
+        for(unsigned w = 0; w < substrings.Size(); w++) {
+            const unsigned L = substrings.Length(w);
+            const int* ids = substrings.Ids(w);
+            for(unsigned s = 0; s < L * (L + 1) / 2; s++) {
+                const int k = ids[s];
+                if(k < 0 || last[k] == w) continue; // too long, or repeated in w
+                last[k] = w;
+                types[k]++;
+            }
+        }
+        affix.resize(n_substrings);
+        for(unsigned k = 0; k < n_substrings; k++)
+            affix[k] = types[k] >= min_affix_types;
+    }
+
+    /* Whether word[i:j], of substring id `id`, can be a `part` morpheme of
+     * a word of length L; ids outside the table are unseen substrings */
+    bool Allows(Part part, unsigned L, unsigned i, unsigned j, int id) const {
+        if(part == STEM)
+            return j - i <= MaxLength(STEM, L) || (i == 0 && j == L);
+        if(j - i > MaxLength(part, L)) return false;
+        return min_affix_types <= 1 || (id >= 0 && id < (int) affix.size() && affix[id]);
+    }
+};
@@ -1,87 +1,8 @@
 #include "prob.h"
+#include "thread_pool.h"
 #include "vocabulary.h"
 #include "corpus.h"
-
-class LexiconModel {
-    public:
-    LexiconModel(float alpha_t, float alpha_f,
-            const Vocabulary& word_vocabulary,
-            const Vocabulary& prefix_vocabulary,
-            const Vocabulary& suffix_vocabulary) :
-        word_vocabulary(word_vocabulary),
-        prefix_vocabulary(prefix_vocabulary),
-        suffix_vocabulary(suffix_vocabulary),
-        prefix_model(prefix_vocabulary.Size(), alpha_t),
-        suffix_model(suffix_vocabulary.Size(), alpha_f) {}
-
-    unsigned Increment(unsigned w, std::mt19937& engine, bool initialize=false) {
-        const std::string& word = word_vocabulary.Convert(w);
-        unsigned t, f, split;
-        if(initialize) {
-            split = prob::randint(engine, 0, word.size());
-            t = prefix_vocabulary.Convert(word.substr(0, split));
-            f = suffix_vocabulary.Convert(word.substr(split));
-        }
-        else {
-            float x = prob::random(engine) * Prob(w);
-            float analysis_prob;
-            for(split = 0 ; split <= word.size(); split++) {
-                t = prefix_vocabulary.Convert(word.substr(0, split));
-                f = suffix_vocabulary.Convert(word.substr(split));
-                analysis_prob = prefix_model.Prob(t) * suffix_model.Prob(f);
-                if(x < analysis_prob || split == word.size()) break;
-                x -= analysis_prob;
-            }
-        }
-        prefix_model.Increment(t);
-        suffix_model.Increment(f);
-        return split;
-    }
-
-    void Decrement(unsigned w, unsigned split) {
-        const std::string& word = word_vocabulary.Convert(w);
-        unsigned t = prefix_vocabulary.Convert(word.substr(0, split));
-        unsigned f = suffix_vocabulary.Convert(word.substr(split));
-        prefix_model.Decrement(t);
-        suffix_model.Decrement(f);
-    }
-    
-    float Prob(unsigned w) const {
-        const std::string& word = word_vocabulary.Convert(w);
-        float prob = 0;
-        for(unsigned split = 0; split <= word.size(); split++) {
-            unsigned t = prefix_vocabulary.Convert(word.substr(0, split));
-            unsigned f = suffix_vocabulary.Convert(word.substr(split));
-            prob += prefix_model.Prob(t) * suffix_model.Prob(f);
-        }
-        return prob;
-    }
-
-    unsigned Decode(unsigned w) const {
-        const std::string& word = word_vocabulary.Convert(w);
-        float max_prob = -1;
-        unsigned best_split;
-        for(unsigned split = 0; split <= word.size(); split++) {
-            unsigned t = prefix_vocabulary.Convert(word.substr(0, split));
-            unsigned f = suffix_vocabulary.Convert(word.substr(split));
-            float prob = prefix_model.Prob(t) * suffix_model.Prob(f);
-            if(prob >= max_prob) {
-                max_prob = prob;
-                best_split = split;
-            }
-        }
-        return best_split;
-    
-    }
-
-    double LogLikelihood() const {
-        return prefix_model.LogLikelihood() + suffix_model.LogLikelihood();
-    }
-
-    private:
-    const Vocabulary& word_vocabulary, prefix_vocabulary, suffix_vocabulary;
-    DirichletMultinomial prefix_model, suffix_model;
-};
+#include "lexicon.h"
 
 int main(int argc, char** argv) {
     assert(argc == 2);
@@ -91,16 +12,12 @@ int main(int argc, char** argv) {
     std::cerr << "Read " << corpus.Size() << " tokens, "
         << word_vocabulary.Size() << " types\n";
 
-    for(auto& seg: corpus) {
-        for(auto& w: seg) {
-            const std::string& word = word_vocabulary.Convert(w);
-            unsigned t, f;
-            for(unsigned split = 0; split <= word.size(); split++) {
-                prefix_vocabulary.Encode(word.substr(0, split));
-                suffix_vocabulary.Encode(word.substr(split));
-            }
+    // Word types are numbered by first occurrence, so this is the order of the corpus
+    for(const std::string& word: word_vocabulary)
+        for(unsigned split = 0; split <= word.size(); split++) {
+            prefix_vocabulary.Encode(word.substr(0, split));
+            suffix_vocabulary.Encode(word.substr(split));
         }
-    }
 
     std::cerr << "Found " << prefix_vocabulary.Size() << " prefixes, "
         << suffix_vocabulary.Size() << " suffixes\n";
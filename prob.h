@@ -1,47 +1,407 @@
 #include <cassert>
 #include <vector>
+#include <algorithm>
 #include <random>
 #include <cmath>
+#include <atomic>
 #include <mutex>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+#include <chrono>
+#include <functional>
+#include <unordered_map>
 #include <iostream>
+#include <new>
 
-/* A thread-safe Multinomial distribution with a Dirichlet prior */
+/* Per-thread slot used to spread updates of shared totals over cache lines */
+inline unsigned ThreadSlot(unsigned n_slots) {
+    return std::hash<std::thread::id>()(std::this_thread::get_id()) % n_slots;
+}
+
+/* A fixed array of per-thread slots, each padded to a whole cache line, whose
+ * storage starts on a cache line boundary (std::vector only guarantees the
+ * alignment of new, and gcc 4.7 has no alignas) */
+template <typename T>
+class CacheLineArray {
+    static_assert(sizeof(T) % 64 == 0, "slots must fill whole cache lines");
+
+    std::vector<char> storage;
+    T* items;
+    size_t n;
+
+    public:
+    CacheLineArray(size_t n) : storage(n * sizeof(T) + 63), items(nullptr), n(n) {
+        char* p = storage.data();
+        items = reinterpret_cast<T*>(p + (64 - reinterpret_cast<uintptr_t>(p) % 64) % 64);
+        for(size_t i = 0; i < n; i++)
+            new (items + i) T();
+    }
+
+    CacheLineArray(const CacheLineArray&) = delete;
+    CacheLineArray& operator=(const CacheLineArray&) = delete;
+
+    ~CacheLineArray() {
+        for(size_t i = 0; i < n; i++)
+            items[i].~T();
+    }
+
+    T& operator[](size_t i) { return items[i]; }
+    const T& operator[](size_t i) const { return items[i]; }
+    T* begin() { return items; }
+    T* end() { return items + n; }
+    const T* begin() const { return items; }
+    const T* end() const { return items + n; }
+};
+
+inline void AtomicAdd(std::atomic<double>& x, double d) {
+    double old = x.load(std::memory_order_relaxed);
+    while(!x.compare_exchange_weak(old, old + d, std::memory_order_relaxed));
+}
+
+/* A sparse, thread-safe map from ids to counts
+ * Open addressing over 64-bit atomic slots packing (id+1, count), so that
+ * lookups and updates of existing ids are single atomic operations. Ids whose
+ * count drops to zero keep their slot until the next rehash. When the table
+ * gets half full it is rehashed into a larger one: writers are then briefly
+ * held back while readers keep using the old table, which is only freed by
+ * Synchronize() (when no other thread can be reading).
+ * Each slot also caches log(alpha + count) along with the count it was
+ * computed for: readers refresh it lazily when the count has changed, and
+ * RefreshLogWeights() recomputes all stale entries in one batched pass. */
+
+class SparseCounts {
+    struct Table {
+        std::vector< std::atomic<uint64_t> > slots;
+        mutable std::vector< std::atomic<uint64_t> > log_weights; // (count, float log weight)
+        std::atomic<size_t> size; // occupied slots
+        Table(size_t capacity) : slots(capacity), log_weights(capacity), size(0) {}
+    };
+
+    static uint64_t PackLogWeight(unsigned count, float log_weight) {
+        uint32_t bits;
+        memcpy(&bits, &log_weight, sizeof(bits));
+        return ((uint64_t) count << 32) | bits;
+    }
+
+    static float UnpackLogWeight(uint64_t v) {
+        const uint32_t bits = v & 0xffffffff;
+        float log_weight;
+        memcpy(&log_weight, &bits, sizeof(bits));
+        return log_weight;
+    }
+
+    struct Writers { // one cache line per thread slot
+        std::atomic<int> active;
+        char padding[64 - sizeof(std::atomic<int>)];
+        Writers() : active(0) {}
+    };
+
+    static const size_t initial_capacity = 1024;
+    static const unsigned n_slots = 64;
+
+    std::atomic<Table*> table;
+    std::vector<Table*> retired;
+    std::atomic<bool> resizing;
+    CacheLineArray<Writers> writers;
+    std::mutex resize_lock;
+    std::atomic<uint64_t> wait_ns; // time spent rehashing or waiting for it
+
+    static uint64_t Nanoseconds(std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - start).count();
+    }
+
+    static uint64_t Key(unsigned k) {
+        return (uint64_t) (k + 1) << 32;
+    }
+
+    static size_t Hash(unsigned k, size_t mask) {
+        return (k * 2654435761u) & mask;
+    }
+
+    /* Slot of id k in `t`, or the empty slot ending its probe sequence */
+    static size_t Find(const Table& t, unsigned k) {
+        const size_t mask = t.slots.size() - 1;
+        size_t slot = Hash(k, mask);
+        while(true) {
+            const uint64_t v = t.slots[slot].load(std::memory_order_acquire);
+            if(v == 0 || (v >> 32) == k + 1) return slot;
+            slot = (slot + 1) & mask;
+        }
+    }
+
+    /* Move the live counts of the current table into a new one with
+     * room to grow, with all writers held back */
+    void Grow(Table* old) {
+        std::lock_guard<std::mutex> guard(resize_lock);
+        if(table.load() != old) return; // somebody else did it
+        const auto start = std::chrono::steady_clock::now();
+        resizing = true;
+        for(auto& w: writers)
+            while(w.active.load() > 0) std::this_thread::yield();
+        size_t live = 0, capacity = initial_capacity;
+        for(auto& slot: old->slots)
+            live += (slot.load(std::memory_order_relaxed) & 0xffffffff) != 0;
+        while(capacity < 4 * live) capacity *= 2;
+        Table* t = new Table(capacity);
+        for(size_t i = 0; i < old->slots.size(); i++) {
+            const uint64_t v = old->slots[i].load(std::memory_order_relaxed);
+            if((v & 0xffffffff) == 0) continue; // empty, or count dropped to zero
+            const size_t slot = Find(*t, (v >> 32) - 1);
+            t->slots[slot].store(v, std::memory_order_relaxed);
+            t->log_weights[slot].store(old->log_weights[i].load(std::memory_order_relaxed),
+                    std::memory_order_relaxed);
+            t->size++;
+        }
+        table.store(t);
+        retired.push_back(old);
+        resizing = false;
+        wait_ns += Nanoseconds(start);
+    }
+
+    public:
+    SparseCounts() : table(new Table(initial_capacity)), resizing(false), writers(n_slots),
+        wait_ns(0) {}
+
+    ~SparseCounts() {
+        Synchronize();
+        delete table.load();
+    }
+
+    unsigned Get(unsigned k) const {
+        const Table& t = *table.load(std::memory_order_acquire);
+        return t.slots[Find(t, k)].load(std::memory_order_relaxed) & 0xffffffff;
+    }
+
+    /* Add `n` (possibly negative) to the count of k and return the previous
+     * count; a count is never taken below zero, which would borrow from the
+     * id packed above it */
+    unsigned Add(unsigned k, int n) {
+        Writers& w = writers[ThreadSlot(n_slots)];
+        while(true) {
+            w.active++;
+            if(resizing) { // wait for the rehash to finish
+                w.active--;
+                const auto start = std::chrono::steady_clock::now();
+                while(resizing) std::this_thread::yield();
+                wait_ns += Nanoseconds(start);
+                continue;
+            }
+            Table* t = table.load();
+            size_t slot = Find(*t, k);
+            uint64_t v = t->slots[slot].load(std::memory_order_acquire);
+            bool grow = false;
+            while((v >> 32) != k + 1) {
+                if(v == 0) { // claim the empty slot for k
+                    if(t->slots[slot].compare_exchange_strong(v, Key(k))) {
+                        grow = 2 * (++t->size) > t->slots.size();
+                        break;
+                    }
+                }
+                else { // taken by another id since Find: keep probing
+                    slot = Find(*t, k);
+                    v = t->slots[slot].load(std::memory_order_acquire);
+                }
+            }
+            uint64_t old;
+            if(n >= 0)
+                old = t->slots[slot].fetch_add(n, std::memory_order_relaxed);
+            else {
+                old = t->slots[slot].load(std::memory_order_relaxed);
+                uint64_t updated;
+                do {
+                    const unsigned c = old & 0xffffffff;
+                    assert(c >= (unsigned) -n);
+                    updated = old - std::min(c, (unsigned) -n);
+                } while(!t->slots[slot].compare_exchange_weak(old, updated,
+                            std::memory_order_relaxed));
+            }
+            w.active--;
+            if(grow) Grow(t);
+            return old & 0xffffffff;
+        }
+    }
+
+    /* Total time spent by writers rehashing the table or held back by it */
+    double WaitSeconds() const {
+        return wait_ns.load() * 1e-9;
+    }
+
+    /* log(alpha + count of k), from the cache when it is up to date */
+    float LogWeight(unsigned k, float alpha, float log_alpha) const {
+        const Table& t = *table.load(std::memory_order_acquire);
+        const size_t slot = Find(t, k);
+        const unsigned c = t.slots[slot].load(std::memory_order_relaxed) & 0xffffffff;
+        if(c == 0) return log_alpha;
+        const uint64_t cached = t.log_weights[slot].load(std::memory_order_relaxed);
+        if((cached >> 32) == c) return UnpackLogWeight(cached);
+        const float log_weight = log(alpha + c);
+        t.log_weights[slot].store(PackLogWeight(c, log_weight), std::memory_order_relaxed);
+        return log_weight;
+    }
+
+    /* Recompute all stale cached log weights, found by scanning the whole
+     * table; the logarithms are computed in a separate loop over a contiguous
+     * buffer, but logf is a scalar library call (gcc does not vectorize it
+     * without -ffast-math), so this only saves lazy recomputations during
+     * sampling; must not run concurrently with Add */
+    void RefreshLogWeights(float alpha) {
+        Table& t = *table.load();
+        std::vector<size_t> stale;
+        std::vector<float> values;
+        for(size_t slot = 0; slot < t.slots.size(); slot++) {
+            const unsigned c = t.slots[slot].load(std::memory_order_relaxed) & 0xffffffff;
+            if(c != 0 && (t.log_weights[slot].load(std::memory_order_relaxed) >> 32) != c) {
+                stale.push_back(slot);
+                values.push_back(alpha + c);
+            }
+        }
+        float* v = values.data();
+        const size_t n = values.size();
+        for(size_t i = 0; i < n; i++)
+            v[i] = logf(v[i]);
+        for(size_t i = 0; i < n; i++) {
+            const unsigned c = t.slots[stale[i]].load(std::memory_order_relaxed) & 0xffffffff;
+            t.log_weights[stale[i]].store(PackLogWeight(c, v[i]), std::memory_order_relaxed);
+        }
+    }
+
+    /* Call f(k, count) for every id with a non-zero count;
+     * must not run concurrently with Add */
+    template <typename F>
+    void ForEach(F f) const {
+        for(auto& slot: table.load()->slots) {
+            const uint64_t v = slot.load(std::memory_order_relaxed);
+            if((v & 0xffffffff) != 0) f((unsigned) ((v >> 32) - 1), (unsigned) (v & 0xffffffff));
+        }
+    }
+
+    /* Free the tables replaced by rehashing; must not run concurrently
+     * with any other operation */
+    void Synchronize() {
+        for(Table* t: retired)
+            delete t;
+        retired.clear();
+    }
+};
+
+/* A thread-safe Multinomial distribution with a Dirichlet prior
+ * Counts are kept in a sparse atomic table: only the ids which have been
+ * observed use memory, however large K is.
+ * In `relaxed` mode the total N, which every update touches, is split into
+ * per-thread shards and only folded back by Synchronize(): probabilities then
+ * use a slightly stale normalizer in exchange for no write sharing on N.
+ * The log-likelihood is maintained incrementally as counts change: each
+ * update adds lgamma(alpha + new count) - lgamma(alpha + old count) to a
+ * per-thread shard, so that it can be queried in O(1) at any time. */
 
 struct DirichletMultinomial {
-    DirichletMultinomial(unsigned size, float concentration)
-        : K(size), count(size), N(0), alpha(concentration) {}
+    static const unsigned n_shards = 64;
+
+    DirichletMultinomial(unsigned size, float concentration, bool relaxed=false)
+        : K(size), alpha(concentration), log_alpha(log(concentration)),
+        N(0), count(), relaxed(relaxed), shards(n_shards) {}
 
     void Increment(unsigned k) {
-        assert(k < K);
-        std::lock_guard<std::mutex> guard(count_lock);
-        count[k]++;
-        N++;
+        Add(k, 1);
     }
 
     void Decrement(unsigned k) {
+        Add(k, -1);
+    }
+
+    /* Add `n` (possibly negative) observations of k */
+    void Add(unsigned k, int n) {
         assert(k < K);
-        std::lock_guard<std::mutex> guard(count_lock);
-        count[k]--;
-        N--;
+        const unsigned old = count.Add(k, n);
+        n = std::max(n, -(int) old); // the count stopped at zero
+        Shard& shard = shards[ThreadSlot(n_shards)];
+        if(relaxed)
+            shard.delta.fetch_add(n, std::memory_order_relaxed);
+        else
+            N.fetch_add(n, std::memory_order_relaxed);
+        double log_gamma = 0; // lgamma(alpha + old + n) - lgamma(alpha + old)
+        if(n == 1)
+            log_gamma = log(alpha + old);
+        else if(n == -1)
+            log_gamma = -log(alpha + old - 1);
+        else if(n != 0)
+            log_gamma = lgamma(alpha + old + n) - lgamma(alpha + old);
+        AtomicAdd(shard.log_gamma, log_gamma);
+    }
+
+    /* Fold the sharded updates of N back (relaxed mode), release
+     * memory from count rehashing and refresh cached log weights;
+     * must not run concurrently with any other operation */
+    void Synchronize() {
+        for(auto& shard: shards)
+            N += shard.delta.exchange(0);
+        count.Synchronize();
+        count.RefreshLogWeights(alpha);
+    }
+
+    unsigned Count(unsigned k) const {
+        assert(k < K);
+        return count.Get(k);
+    }
+
+    /* Call f(k, count[k]) for every k with a non-zero count: O(|support|) */
+    template <typename F>
+    void ForEach(F f) const {
+        count.ForEach(f);
     }
 
     float Prob(unsigned k) const { // Posterior predictive: p(x_n=k | x^-n)
         assert(k < K);
-        return (alpha + count[k])/(K * alpha + N);
+        return (alpha + count.Get(k)) / (K * alpha + N.load(std::memory_order_relaxed));
+    }
+
+    /* Unnormalized log posterior predictive: log(alpha + count[k]), cached;
+     * ids k >= K stand for unseen outcomes and get log(alpha) */
+    float LogWeight(unsigned k) const {
+        return count.LogWeight(k, alpha, log_alpha);
+    }
+
+    /* Log of the posterior predictive normalizer, log(K * alpha + N) */
+    double LogNormalizer() const {
+        return log(K * alpha + N.load(std::memory_order_relaxed));
+    }
+
+    double LogProb(unsigned k) const {
+        return LogWeight(k) - LogNormalizer();
+    }
+
+    /* Total number of observations, including unsynchronized updates */
+    unsigned Total() const {
+        int total = N;
+        for(auto& shard: shards)
+            total += shard.delta.load(std::memory_order_relaxed);
+        return total;
     }
 
     double LogLikelihood() const { // p(x|alpha) = \int_theta p(x|theta) p(theta|alpha)
-        double ll = lgamma(K * alpha) - K * lgamma(alpha) - lgamma(K * alpha + N);
-        for(unsigned k = 0; k < K; k++)
-            ll += lgamma(alpha + count[k]);
+        double ll = lgamma(K * alpha) - lgamma(K * alpha + Total());
+        for(auto& shard: shards) // sum of lgamma(alpha + count[k]) - lgamma(alpha)
+            ll += shard.log_gamma.load(std::memory_order_relaxed);
         return ll;
     }
 
     unsigned K;
-    float alpha;
-    unsigned N;
-    std::vector<unsigned> count;
-    std::mutex count_lock;
+    float alpha, log_alpha;
+    std::atomic<unsigned> N;
+    SparseCounts count;
+
+    private:
+    struct Shard { // one cache line per shard: the double first, so no hidden padding
+        std::atomic<double> log_gamma;
+        std::atomic<int> delta;
+        char padding[64 - sizeof(std::atomic<double>) - sizeof(std::atomic<int>)];
+        Shard() : log_gamma(0), delta(0) {}
+    };
+
+    bool relaxed;
+    CacheLineArray<Shard> shards;
 
     friend std::ostream& operator<<(std::ostream&, const DirichletMultinomial&);
 };
@@ -49,32 +409,36 @@ struct DirichletMultinomial {
 
 std::ostream& operator<<(std::ostream& os, const DirichletMultinomial& m) {
     unsigned support = 0;
-    for(unsigned k = 0; k < m.K; k++)
-        support += (m.count[k] > 0);
+    m.ForEach([&support] (unsigned k, unsigned c) { support++; });
     return os << "Multinomial(N=" << m.N << " |support|=" << support << ")"
         << " ~ Dir(K=" << m.K << ", alpha=" << m.alpha << ")";
 }
 
-/* A Geometric distribution with a Beta prior */
+/* A thread-safe Geometric distribution with a Beta prior */
 
 struct BetaGeometric {
-    unsigned L, N;
+    std::atomic<unsigned> L, N;
     float alpha, beta;
 
     BetaGeometric(float alpha, float beta) : L(0), N(0), alpha(alpha), beta(beta) {}
 
     void Increment(unsigned l) {
-        L += l;
-        N++;
+        Add(l, 1);
     }
 
     void Decrement(unsigned l){
-        L -= l;
-        N--;
+        Add(-(int) l, -1);
+    }
+
+    /* Add `n` observations of total length `l` (both possibly negative) */
+    void Add(int l, int n) {
+        L.fetch_add(l, std::memory_order_relaxed);
+        N.fetch_add(n, std::memory_order_relaxed);
     }
 
     float Stop() const { // E[p|alpha] - used to approximate posterior predictive
-        return (alpha + N)/(alpha + N + beta + L); // mean = 1/p - 1 = (beta+L)/(alpha+N)
+        const float n = N.load(std::memory_order_relaxed), l = L.load(std::memory_order_relaxed);
+        return (alpha + n)/(alpha + n + beta + l); // mean = 1/p - 1 = (beta+L)/(alpha+N)
     }
 
     float Prob(unsigned l) const {
@@ -99,6 +463,89 @@ std::ostream& operator<<(std::ostream& os, const BetaGeometric& m) {
 }
 
 
+/* Thread-local changes to a shared DirichletMultinomial
+ * Probabilities combine the shared counts with the pending changes,
+ * which only become visible to other threads after Merge() */
+
+struct DirichletMultinomialDelta {
+    DirichletMultinomialDelta(DirichletMultinomial& base) : base(base), N(0) {}
+
+    void Increment(unsigned k) {
+        delta[k]++;
+        N++;
+    }
+
+    void Decrement(unsigned k) {
+        delta[k]--;
+        N--;
+    }
+
+    float Prob(unsigned k) const {
+        int d = 0;
+        if(!delta.empty()) {
+            auto it = delta.find(k);
+            if(it != delta.end()) d = it->second;
+        }
+        return (base.alpha + base.Count(k) + d)
+            / (base.K * base.alpha + base.N.load(std::memory_order_relaxed) + N);
+    }
+
+    float LogWeight(unsigned k) const {
+        if(!delta.empty()) {
+            auto it = delta.find(k);
+            if(it != delta.end() && it->second != 0)
+                return log(base.alpha + base.Count(k) + it->second);
+        }
+        return base.LogWeight(k);
+    }
+
+    double LogNormalizer() const {
+        return log(base.K * base.alpha + base.N.load(std::memory_order_relaxed) + N);
+    }
+
+    void Merge() {
+        for(auto& kd: delta)
+            if(kd.second != 0) base.Add(kd.first, kd.second);
+        delta.clear();
+        N = 0;
+    }
+
+    DirichletMultinomial& base;
+    std::unordered_map<unsigned, int> delta;
+    int N;
+};
+
+/* Thread-local changes to a shared BetaGeometric */
+
+struct BetaGeometricDelta {
+    BetaGeometricDelta(BetaGeometric& base) : base(base), L(0), N(0) {}
+
+    void Increment(unsigned l) {
+        L += l;
+        N++;
+    }
+
+    void Decrement(unsigned l) {
+        L -= l;
+        N--;
+    }
+
+    float Stop() const {
+        const float n = base.N.load(std::memory_order_relaxed) + N;
+        const float l = base.L.load(std::memory_order_relaxed) + L;
+        return (base.alpha + n)/(base.alpha + n + base.beta + l);
+    }
+
+    void Merge() {
+        base.Add(L, N);
+        L = N = 0;
+    }
+
+    BetaGeometric& base;
+    int L, N;
+};
+
+
 /* Utility functions for generating random numbers */
 
 namespace prob {
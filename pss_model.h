@@ -1,61 +1,80 @@
-struct Segmentation {
-    vector<unsigned> prefixes, suffixes;
-    unsigned stem;
-};
-
+/* Decode a segmentation into `seg` from the `n` output labels of a path
+ * through the lattice of word type `w`, using its substring ids */
+void ReadSegmentation(const int* labels, size_t n,
+        const SubstringTable& substrings, unsigned w, Segmentation& seg) {
+    seg.prefixes.clear();
+    seg.suffixes.clear();
+    unsigned stem = -1;
+    unsigned part = 0;
+    unsigned start = 0, position = 0; // current morpheme is word[start:position]
+    for(size_t k = 0; k < n; k++) {
+        if(labels[k] == mb) { // end of prefix/suffix morpheme
+            (part == 0 ? seg.prefixes : seg.suffixes).push_back(substrings.Id(w, start, position));
+            start = position;
+        }
+        else if(labels[k] == ss) { // prefix -> stem
+            part++;
+        }
+        else if(labels[k] == se) { // stem -> suffix
+            stem = substrings.Id(w, start, position);
+            start = position;
+            part++;
+        }
+        else if(labels[k] != 0) position++; // read morpheme character
+    }
+    assert(stem != -1);
+    seg.stem = stem;
+}
 
 /* Decode a segmentation from the linear chain character acceptor `path`
- * using `trie` to map character sequences to substrings */
+ * using the substring ids of word type `w` */
 template <typename Arc>
 const Segmentation ReadSegmentation(const fst::ExpandedFst<Arc>& path,
-        const Trie& trie) {
-    vector<unsigned> prefixes, suffixes;
-    unsigned stem = -1;
-    unsigned part = 0;
-    const Trie* node = &trie;
+        const SubstringTable& substrings, unsigned w) {
+    std::vector<int> labels;
     for(fst::StateIterator<fst::ExpandedFst<Arc>> siter(path);
             !siter.Done(); siter.Next()) {
         typename fst::ExpandedFst<Arc>::StateId state_id = siter.Value();
         for(fst::ArcIterator<fst::ExpandedFst<Arc>> aiter(path, state_id);
-                !aiter.Done(); aiter.Next()) {
-            const Arc &arc = aiter.Value();
-            if(arc.olabel == '^') { // end of prefix/suffix morpheme
-                (part == 0 ? prefixes : suffixes).push_back(node->label);
-                node = &trie;
-            }
-            else if(arc.olabel == '<') { // prefix -> stem
-                part++;
-            }
-            else if(arc.olabel == '>') { // stem -> suffix
-                stem = node->label;
-                node = &trie;
-                part++;
-            }
-            else node = &node->nodes.at(arc.olabel); // read morpheme character
-        }
+                !aiter.Done(); aiter.Next())
+            labels.push_back(aiter.Value().olabel);
     }
-    assert(stem != -1);
-    return Segmentation {prefixes, suffixes, stem};
+    Segmentation seg;
+    ReadSegmentation(labels.data(), labels.size(), substrings, w, seg);
+    return seg;
 }
 
+/* Lattice backends: OpenFst composition (banana.h)
+ * or native dynamic programming over character positions (chart.h) */
+enum Backend { OPENFST, NATIVE };
+
 class SegmentationModel {
     public:
     SegmentationModel(float alpha_prefix, float alpha_stem, float alpha_suffix,
             const Vocabulary& word_vocabulary, unsigned n_substrings,
-            const std::vector<Trie>& tries) :
-        word_vocabulary(word_vocabulary),
-        tries(tries), chains(),
-        prefix_model(n_substrings, alpha_prefix),
-        stem_model(n_substrings, alpha_stem),
-        suffix_model(n_substrings, alpha_suffix),
+            const SubstringTable& substrings, Backend backend=NATIVE,
+            bool relaxed_counts=false) :
+        backend(backend), filter(), temperature(1),
+        prefix_model(n_substrings, alpha_prefix, relaxed_counts),
+        stem_model(n_substrings, alpha_stem, relaxed_counts),
+        suffix_model(n_substrings, alpha_suffix, relaxed_counts),
         prefix_length_model(1, 1),
-        suffix_length_model(1, 1) {
-            // Pre-compute linear chain character log-acceptor for each word
-            for(const auto& word: word_vocabulary)
-                chains.push_back(LinearChain<fst::LogArc>(word));
-        }
+        suffix_length_model(1, 1),
+        word_vocabulary(word_vocabulary),
+        substrings(substrings),
+        skeletons(word_vocabulary.Size()), skeleton_flags(word_vocabulary.Size()) {}
+
+    /* Sample a segmentation of word `w` into `seg` (reusing its storage)
+     * and add it to the counts */
+    void Increment(unsigned w, std::mt19937& engine, Chart& chart, Segmentation& seg,
+            bool initialize=false);
 
-    const Segmentation Increment(unsigned w, std::mt19937& engine, bool initialize=false);
+    const Segmentation Increment(unsigned w, std::mt19937& engine, Chart& chart,
+            bool initialize=false) {
+        Segmentation seg;
+        Increment(w, engine, chart, seg, initialize);
+        return seg;
+    }
 
     void Decrement(unsigned w, const Segmentation& seg) {
         const std::string& word = word_vocabulary.Convert(w);
@@ -68,35 +87,158 @@ class SegmentationModel {
         suffix_length_model.Decrement(seg.suffixes.size());
     }
 
+    /* Fold sharded count totals back into the models (relaxed counts) */
+    void Synchronize() {
+        prefix_model.Synchronize();
+        stem_model.Synchronize();
+        suffix_model.Synchronize();
+    }
+
+    /* Resample the segmentations of the `n` tokens of word `w` listed in
+     * `tokens`, building the chart only once (native backend).
+     * Returns the number of accepted moves, and adds to `changed` the number
+     * of them which changed a segmentation */
+    unsigned IncrementType(unsigned w, const unsigned* tokens, unsigned n,
+            SegmentationStore& segs, std::mt19937& engine, Chart& chart, size_t& changed);
+
+    /* Log-probability of segmentation `seg` under the current counts */
+    double LogProb(const Segmentation& seg) const;
+
     /* Obtain most likely segmentation of word `w` using Viterbi algorithm */
+    const Segmentation Decode(unsigned w, Chart& chart) const {
+        return Decode(w, chart, backend);
+    }
+
     const Segmentation Decode(unsigned w) const {
-        const fst::StdVectorFst lattice = MakeLattice<fst::StdArc>(w);
-        fst::StdVectorFst best;
-        fst::ShortestPath(lattice, &best);
-        fst::TopSort(&best);
-        const Segmentation seg = ReadSegmentation(best, tries[w]);
-        return seg;
+        Chart chart;
+        return Decode(w, chart);
+    }
+
+    /* The n most likely segmentations of word `w` with their log-probabilities,
+     * best first (native backend) */
+    unsigned Decode(unsigned w, unsigned n, Chart& chart,
+            std::vector<Segmentation>& segs, std::vector<double>& scores) const {
+        chart.Load(substrings, w);
+        chart.Fill(prefix_model, stem_model, suffix_model,
+                prefix_length_model, suffix_length_model, filter, true);
+        std::vector< std::vector<unsigned> > prefixes, suffixes;
+        std::vector<unsigned> stems;
+        const unsigned m = chart.NBest(n, prefixes, stems, suffixes, scores);
+        segs.resize(m);
+        for(unsigned k = 0; k < m; k++)
+            segs[k] = Segmentation {prefixes[k], suffixes[k], stems[k]};
+        return m;
+    }
+
+    /* Most likely segmentation of a word given the triangular array of its
+     * substring ids (see SubstringTable), with the native backend; used for
+     * words outside the training vocabulary, whose unseen substrings can be
+     * given any id >= the number of substrings */
+    const Segmentation Decode(unsigned L, const int* ids, Chart& chart) const {
+        chart.Load(L, ids);
+        return Viterbi(chart);
+    }
+
+    /* Compare the two backends on every word type under the current counts:
+     * log-partition functions must agree, as well as Viterbi segmentations */
+    void CheckBackends(std::ostream& out) const {
+        Chart chart;
+        double max_error = 0, max_skeleton_error = 0;
+        unsigned disagreements = 0;
+        for(unsigned w = 0; w < word_vocabulary.Size(); w++) {
+            // OpenFst shortest distance is the reference for both hand-written DPs
+            const double reference = LogPartition(w, chart, OPENFST);
+            max_error = std::max(max_error,
+                    std::abs(LogPartition(w, chart, NATIVE) - reference));
+            const double skeleton = Skeleton(w).Fill(prefix_model, stem_model, suffix_model,
+                    prefix_length_model, suffix_length_model, 1, chart.lattice);
+            max_skeleton_error = std::max(max_skeleton_error, std::abs(skeleton - reference));
+            const Segmentation native = Decode(w, chart, NATIVE);
+            const Segmentation openfst = Decode(w, chart, OPENFST);
+            if(native != openfst)
+                disagreements++;
+        }
+        out << "Backend check: max |log Z error|=" << max_error
+            << " (lattice skeleton: " << max_skeleton_error << ")"
+            << " Viterbi disagreements=" << disagreements
+            << "/" << word_vocabulary.Size() << "\n";
     }
 
-    /* Full log-likelihood of the model */
+    /* Total time writers spent held back by count table rehashing */
+    double CountWaitSeconds() const {
+        return prefix_model.count.WaitSeconds() + stem_model.count.WaitSeconds()
+            + suffix_model.count.WaitSeconds();
+    }
+
+    /* Full log-likelihood of the model, maintained incrementally: O(1) */
     double LogLikelihood() const {
         return prefix_model.LogLikelihood() + prefix_length_model.LogLikelihood()
             + stem_model.LogLikelihood()
-            + suffix_model.LogLikelihood() + suffix_model.LogLikelihood();
+            + suffix_model.LogLikelihood() + suffix_length_model.LogLikelihood();
     }
 
+    Backend backend;
+    MorphemeFilter filter; // allowed morphemes, all by default
+    double temperature; // lattice weights are divided by it when sampling
     DirichletMultinomial prefix_model, stem_model, suffix_model;
     BetaGeometric prefix_length_model, suffix_length_model;
 
     private:
-    /* Create a lattice of a given type for word `w` */
+    void Add(const Segmentation& seg);
+
+    /* Sample a segmentation of word `w` from its OpenFst lattice into `seg` */
+    void Sample(unsigned w, std::mt19937& engine, bool initialize, Chart& chart,
+            Segmentation& seg) const;
+
+    /* Lattice topology of word `w`, built on first use by any thread */
+    const LatticeSkeleton& Skeleton(unsigned w) const {
+        std::call_once(skeleton_flags[w], [this, w] {
+            skeletons[w].reset(new LatticeSkeleton(substrings, w,
+                        prefix_model, stem_model, suffix_model,
+                        prefix_length_model, suffix_length_model, filter));
+        });
+        return *skeletons[w];
+    }
+
+    /* Sample a segmentation of word `w` from the native chart into `seg` */
+    void Sample(unsigned w, std::mt19937& engine, Chart& chart, bool initialize,
+            Segmentation& seg) const {
+        chart.Load(substrings, w);
+        chart.Fill(prefix_model, stem_model, suffix_model,
+                prefix_length_model, suffix_length_model, filter, false, initialize,
+                temperature);
+        if(chart.stats) {
+            chart.stats->Lap(chart.stats->build);
+            const unsigned L = substrings.Length(w);
+            chart.stats->AddLattice(L, L + 1, chart.Arcs());
+        }
+        chart.Trace(seg.prefixes, seg.stem, seg.suffixes, &engine);
+        if(chart.stats) chart.stats->Lap(chart.stats->sample);
+    }
+
+    const Segmentation Decode(unsigned w, Chart& chart, Backend backend) const;
+
+    /* Best segmentation of the word loaded in `chart` */
+    const Segmentation Viterbi(Chart& chart) const {
+        Segmentation seg;
+        chart.Fill(prefix_model, stem_model, suffix_model,
+                prefix_length_model, suffix_length_model, filter, true);
+        chart.Trace(seg.prefixes, seg.stem, seg.suffixes);
+        return seg;
+    }
+
+    /* Log of the total weight of all segmentations of word `w` */
+    double LogPartition(unsigned w, Chart& chart, Backend backend) const;
+
+    public:
+    /* Create a lattice of a given type for word `w` (OpenFst backend) */
     template <typename Arc>
     inline fst::VectorFst<Arc> MakeLattice(unsigned w) const {
-        const fst::VectorFst<Arc> grammar = BuildGrammar<Arc>(tries[w], 
+        const fst::VectorFst<Arc> grammar = BuildGrammar<Arc>(substrings, w,
                 prefix_model, stem_model, suffix_model,
-                prefix_length_model, suffix_length_model);
+                prefix_length_model, suffix_length_model, filter);
 
-        const fst::VectorFst<Arc>& word_fst = LinearChain<Arc>(word_vocabulary.Convert(w));
+        const fst::VectorFst<Arc>& word_fst = LinearChain<Arc>(substrings, w);
 
         fst::VectorFst<Arc> lattice;
         fst::Compose(word_fst, grammar, &lattice);
@@ -105,52 +247,80 @@ class SegmentationModel {
         return lattice;
     }
 
+    private:
     const Vocabulary& word_vocabulary;
-    const std::vector<Trie>& tries;
-    std::vector< fst::VectorFst<fst::LogArc> > chains;
+    const SubstringTable& substrings;
+    // Built on first use and kept for the lifetime of the model: O(L^2) arcs
+    // for a word of L characters, so memory grows with the vocabulary (README)
+    mutable std::vector< std::unique_ptr<LatticeSkeleton> > skeletons;
+    mutable std::vector<std::once_flag> skeleton_flags;
 
+    friend class SegmentationWorker;
     friend std::ostream& operator<<(std::ostream&, const SegmentationModel&);
 };
 
-/* Specialization for log-lattices which use pre-computed word linear chains */
-template <>
-fst::VectorFst<fst::LogArc> SegmentationModel::MakeLattice(unsigned w) const {
-    const fst::VectorFst<fst::LogArc> grammar = BuildGrammar<fst::LogArc>(tries[w], 
-            prefix_model, stem_model, suffix_model,
-            prefix_length_model, suffix_length_model);
+/* Sample a segmentation of word `w` from its cached lattice, reweighted with
+ * the current counts (uniform arc choices to initialize) */
+void SegmentationModel::Sample(unsigned w, std::mt19937& engine, bool initialize,
+        Chart& chart, Segmentation& seg) const {
+    const LatticeSkeleton& skeleton = Skeleton(w);
+    LatticeScratch& scratch = chart.lattice;
+    if(!initialize)
+        skeleton.Fill(prefix_model, stem_model, suffix_model,
+                prefix_length_model, suffix_length_model, temperature, scratch);
+    if(chart.stats) {
+        chart.stats->Lap(chart.stats->build);
+        chart.stats->AddLattice(substrings.Length(w), skeleton.NumStates(), skeleton.NumArcs());
+    }
+    skeleton.Sample(engine, initialize, scratch);
+    ReadSegmentation(scratch.labels.data(), scratch.labels.size(), substrings, w, seg);
+    if(chart.stats) chart.stats->Lap(chart.stats->sample);
+}
+
+const Segmentation SegmentationModel::Decode(unsigned w, Chart& chart,
+        Backend backend) const {
+    if(backend == NATIVE) {
+        chart.Load(substrings, w);
+        return Viterbi(chart);
+    }
+    const fst::StdVectorFst lattice = MakeLattice<fst::StdArc>(w);
+    fst::StdVectorFst best;
+    fst::ShortestPath(lattice, &best);
+    fst::TopSort(&best);
+    const Segmentation seg = ReadSegmentation(best, substrings, w);
+    return seg;
+}
 
-    const fst::VectorFst<fst::LogArc>& word_fst = chains[w];
+double SegmentationModel::LogPartition(unsigned w, Chart& chart,
+        Backend backend) const {
+    if(backend == NATIVE) {
+        chart.Load(substrings, w);
+        return chart.Fill(prefix_model, stem_model, suffix_model,
+                prefix_length_model, suffix_length_model, filter);
+    }
+    const fst::LogVectorFst lattice = MakeLattice<fst::LogArc>(w);
+    std::vector<fst::LogWeight> beta;
+    fst::ShortestDistance<fst::LogArc>(lattice, &beta, true);
+    return -beta[lattice.Start()].Value();
+}
 
-    fst::VectorFst<fst::LogArc> lattice;
-    fst::Compose(word_fst, grammar, &lattice);
-    fst::RmEpsilon(&lattice);
+void SegmentationModel::Increment(unsigned w, std::mt19937& engine, Chart& chart,
+        Segmentation& seg, bool initialize) {
+    if(chart.stats) chart.stats->Start();
+    if(backend == NATIVE)
+        Sample(w, engine, chart, initialize, seg);
+    else
+        Sample(w, engine, initialize, chart, seg);
 
-    return lattice;
+    Add(seg);
+    if(chart.stats) {
+        chart.stats->Lap(chart.stats->update);
+        chart.stats->tokens++;
+    }
 }
 
-const Segmentation SegmentationModel::Increment(unsigned w,
-        std::mt19937& engine, bool initialize) {
-    fst::LogVectorFst log_lattice = MakeLattice<fst::LogArc>(w);
-    fst::LogVectorFst sampled;
-    int seed = prob::randint(engine, -INT_MAX, INT_MAX);
-    if(initialize) {
-        // Uniform initialization
-        fst::UniformArcSelector<fst::LogArc> selector(seed);
-        fst::RandGenOptions< fst::UniformArcSelector<fst::LogArc> > options(selector);
-        fst::RandGen(log_lattice, &sampled);
-    }
-    else {
-        // Sample from distribution defined by lattice
-        std::vector<fst::LogWeight> beta;
-        fst::ShortestDistance<fst::LogArc>(log_lattice, &beta, true);
-        fst::Reweight<fst::LogArc>(&log_lattice, beta, fst::REWEIGHT_TO_INITIAL);
-        fst::LogProbArcSelector<fst::LogArc> selector(seed);
-        fst::RandGenOptions< fst::LogProbArcSelector<fst::LogArc> > options(selector);
-        fst::RandGen(log_lattice, &sampled, options);
-    }
-
-    // Increment corresponding model variables
-    const Segmentation seg = ReadSegmentation(sampled, tries[w]);
+/* Increment model variables corresponding to `seg` */
+void SegmentationModel::Add(const Segmentation& seg) {
     for(unsigned p: seg.prefixes)
         prefix_model.Increment(p);
     prefix_length_model.Increment(seg.prefixes.size());
@@ -158,9 +328,134 @@ const Segmentation SegmentationModel::Increment(unsigned w,
     for(unsigned s: seg.suffixes)
         suffix_model.Increment(s);
     suffix_length_model.Increment(seg.suffixes.size());
-    return seg;
 }
 
+double SegmentationModel::LogProb(const Segmentation& seg) const {
+    double lp = log(prefix_length_model.Stop()) + log(suffix_length_model.Stop())
+        + seg.prefixes.size() * log(1 - prefix_length_model.Stop())
+        + seg.suffixes.size() * log(1 - suffix_length_model.Stop())
+        + stem_model.LogProb(seg.stem);
+    for(unsigned p: seg.prefixes)
+        lp += prefix_model.LogProb(p);
+    for(unsigned s: seg.suffixes)
+        lp += suffix_model.LogProb(s);
+    return lp;
+}
+
+/* Type-level sampling: the chart of word `w` is filled once with the current
+ * counts and serves as an independence proposal for each of its tokens in
+ * turn. Every token is then updated by a Metropolis-Hastings step targeting
+ * its exact conditional (tempered when annealing), which accounts for the
+ * count changes made by the previous tokens of the type. The proposal
+ * probabilities of the current and proposed segmentations both come from
+ * the chart, i.e. from the counts it was filled with. */
+unsigned SegmentationModel::IncrementType(unsigned w, const unsigned* tokens,
+        unsigned n, SegmentationStore& segs, std::mt19937& engine,
+        Chart& chart, size_t& changed) {
+    ThreadStats* stats = chart.stats;
+    if(stats) stats->Start();
+    chart.Load(substrings, w);
+    const double total = chart.Fill(prefix_model, stem_model, suffix_model,
+            prefix_length_model, suffix_length_model, filter, false, false, temperature);
+    if(stats) {
+        stats->Lap(stats->build);
+        const unsigned L = substrings.Length(w);
+        stats->AddLattice(L, L + 1, chart.Arcs());
+    }
+
+    Segmentation seg, proposed;
+    unsigned accepted = 0;
+    for(unsigned k = 0; k < n; k++) {
+        segs.Get(tokens[k], seg);
+        Decrement(w, seg);
+        if(stats) stats->Lap(stats->update);
+        // Both proposal probabilities are read off the chart, so that they
+        // use the same counts even when other threads have changed them
+        const double proposal = chart.Weight(seg.prefixes, seg.stem, seg.suffixes) - total;
+        const double proposed_proposal = chart.Trace(proposed.prefixes, proposed.stem,
+                proposed.suffixes, &engine) - total;
+        const double log_ratio = (LogProb(proposed) - LogProb(seg)) / temperature
+            + proposal - proposed_proposal;
+        if(log_ratio >= 0 || log(prob::random(engine)) < log_ratio) {
+            accepted++;
+            if(segs.Set(tokens[k], proposed)) changed++;
+            std::swap(seg, proposed);
+        }
+        if(stats) stats->Lap(stats->sample);
+        Add(seg);
+        if(stats) stats->Lap(stats->update);
+    }
+    if(stats) stats->tokens += n;
+    return accepted;
+}
+
+
+/* Approximate distributed sampling (AD-LDA style)
+ * A worker samples its tokens against the shared counts plus its own pending
+ * changes, which are only written to the shared model by Merge(). Workers
+ * therefore see stale counts from each other but never write-share them. */
+class SegmentationWorker {
+    public:
+    SegmentationWorker(SegmentationModel& model) :
+        model(model),
+        prefix_model(model.prefix_model),
+        stem_model(model.stem_model),
+        suffix_model(model.suffix_model),
+        prefix_length_model(model.prefix_length_model),
+        suffix_length_model(model.suffix_length_model) {}
+
+    /* Sample a segmentation of word `w` into `seg` (reusing its storage) */
+    void Increment(unsigned w, std::mt19937& engine, Chart& chart, Segmentation& seg) {
+        ThreadStats* stats = chart.stats;
+        if(stats) stats->Start();
+        chart.Load(model.substrings, w);
+        chart.Fill(prefix_model, stem_model, suffix_model,
+                prefix_length_model, suffix_length_model, model.filter, false, false,
+                model.temperature);
+        if(stats) {
+            stats->Lap(stats->build);
+            const unsigned L = model.substrings.Length(w);
+            stats->AddLattice(L, L + 1, chart.Arcs());
+        }
+        chart.Trace(seg.prefixes, seg.stem, seg.suffixes, &engine);
+        if(stats) stats->Lap(stats->sample);
+        for(unsigned p: seg.prefixes)
+            prefix_model.Increment(p);
+        prefix_length_model.Increment(seg.prefixes.size());
+        stem_model.Increment(seg.stem);
+        for(unsigned s: seg.suffixes)
+            suffix_model.Increment(s);
+        suffix_length_model.Increment(seg.suffixes.size());
+        if(stats) {
+            stats->Lap(stats->update);
+            stats->tokens++;
+        }
+    }
+
+    void Decrement(unsigned w, const Segmentation& seg) {
+        for(unsigned p: seg.prefixes)
+            prefix_model.Decrement(p);
+        prefix_length_model.Decrement(seg.prefixes.size());
+        stem_model.Decrement(seg.stem);
+        for(unsigned s: seg.suffixes)
+            suffix_model.Decrement(s);
+        suffix_length_model.Decrement(seg.suffixes.size());
+    }
+
+    /* Publish pending changes to the shared model */
+    void Merge() {
+        prefix_model.Merge();
+        stem_model.Merge();
+        suffix_model.Merge();
+        prefix_length_model.Merge();
+        suffix_length_model.Merge();
+    }
+
+    private:
+    SegmentationModel& model;
+    DirichletMultinomialDelta prefix_model, stem_model, suffix_model;
+    BetaGeometricDelta prefix_length_model, suffix_length_model;
+};
 
 std::ostream& operator<<(std::ostream& os, const SegmentationModel& m) {
     return os << "SegmentationModel(prefix ~ " << m.prefix_model
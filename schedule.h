@@ -0,0 +1,82 @@
+#include <vector>
+#include <numeric>
+#include <algorithm>
+
+/* Cost-balanced order of the work of a sampling iteration
+ * The cost of sampling a word grows roughly quadratically with its length
+ * (the number of morpheme arcs of its lattice), so splitting the corpus into
+ * chunks of equal token counts leaves the threads holding long words running
+ * alone before each iteration barrier. A schedule sorts groups of items (the
+ * tokens of each word type, or the word types themselves) by decreasing
+ * estimated cost and cuts the sequence into chunks of about equal total cost:
+ * expensive words get chunks of their own and run first, and the cheap words
+ * that come last fill the gaps, in chunks small enough to be stolen by idle
+ * workers. Keeping the tokens of a type together also makes consecutive
+ * updates touch the same counts. The order only depends on the corpus, so a
+ * schedule is built once and reused at every iteration. */
+
+/* Estimated cost of sampling a word of length L: arcs of its lattice under
+ * `filter` (spans of each morpheme part, see Chart::Fill) plus a linear term
+ * for reading the segmentation and updating counts */
+inline double LatticeCost(const MorphemeFilter& filter, unsigned L) {
+    double cost = 2 * L + 4;
+    for(Part part: {PREFIX, STEM, SUFFIX}) {
+        const double m = filter.MaxLength(part, L);
+        cost += m * (L + 1) - m * (m + 1) / 2; // spans of length 1..m
+    }
+    return cost;
+}
+
+class Schedule {
+    std::vector<unsigned> order; // items, most expensive groups first
+    std::vector<size_t> bounds; // chunk c is order[bounds[c]..bounds[c+1])
+
+    public:
+    Schedule() : order(), bounds(1, 0) {}
+
+    /* Order the items of groups g, members[start[g]..start[g+1]), which cost
+     * item_costs[g] each, into about `n_chunks` chunks of equal cost */
+    Schedule(const std::vector<double>& item_costs, const std::vector<unsigned>& start,
+            const std::vector<unsigned>& members, size_t n_chunks)
+        : order(), bounds(1, 0) {
+        const size_t n_groups = item_costs.size();
+        std::vector<unsigned> groups(n_groups);
+        std::iota(groups.begin(), groups.end(), 0);
+        std::stable_sort(groups.begin(), groups.end(), [&item_costs] (unsigned a, unsigned b) {
+            return item_costs[a] > item_costs[b];
+        });
+        double total = 0;
+        for(unsigned g = 0; g < n_groups; g++)
+            total += item_costs[g] * (start[g+1] - start[g]);
+        const double target = total / std::max<size_t>(1, n_chunks);
+
+        order.reserve(members.size());
+        double cost = 0;
+        for(unsigned g: groups)
+            for(unsigned m = start[g]; m < start[g+1]; m++) {
+                order.push_back(members[m]);
+                cost += item_costs[g];
+                if(cost >= target) {
+                    bounds.push_back(order.size());
+                    cost = 0;
+                }
+            }
+        if(order.size() > bounds.back())
+            bounds.push_back(order.size());
+    }
+
+    /* Submit f(item, thread) for every item, chunk by chunk; the schedule
+     * must outlive the tasks (until pool.wait()) */
+    template<typename F>
+    void Enqueue(ThreadPool& pool, F f) const {
+        pool.enqueue_chunks(order, bounds, f);
+    }
+
+    size_t Size() const {
+        return order.size();
+    }
+
+    size_t Chunks() const {
+        return bounds.size() - 1;
+    }
+};
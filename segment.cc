@@ -1,17 +1,77 @@
 #include <fst/fstlib.h>
 #include <thread>
+#include <fstream>
 #include "thread_pool.h"
+#include "utf8.h"
+#include "stats.h"
 #include "vocabulary.h"
 #include "corpus.h"
 #include "prob.h"
-#include "trie.h"
+#include "substrings.h"
+#include "morphemes.h"
+#include "segmentations.h"
 #include "banana.h"
+#include "chart.h"
 #include "pss_model.h"
+#include "checkpoint.h"
+#include "distributed.h"
+#include "schedule.h"
 
-const unsigned NTHREADS = 8;
+/* Number of segmentations changed by one thread in an iteration,
+ * padded to a cache line */
+struct ChangeCount {
+    size_t n;
+    char pad[64 - sizeof(size_t)];
+};
+
+/* Whether sampling has stopped making progress: over the last `window`
+ * iterations, the mean log-likelihood of the second half improved on the
+ * first half by less than a fraction `tolerance`, and so did the mean rate
+ * of segmentation changes */
+bool Converged(const std::vector<double>& lls, const std::vector<double>& rates,
+        unsigned window, double tolerance) {
+    const size_t n = lls.size(), half = window / 2;
+    if(n < window) return false;
+    double ll1 = 0, ll2 = 0, rate1 = 0, rate2 = 0;
+    for(size_t k = 0; k < half; k++) {
+        ll1 += lls[n - window + k] / half;
+        ll2 += lls[n - half + k] / half;
+        rate1 += rates[n - window + k] / half;
+        rate2 += rates[n - half + k] / half;
+    }
+    return ll2 - ll1 < tolerance * std::abs(ll1) && rate1 - rate2 <= tolerance * rate1;
+}
+
+/* Word types which share a substring of at least `min_length` characters
+ * with one of the types from `first_new` on (which are all included) */
+std::vector<uint8_t> Neighbors(const SubstringTable& substrings, unsigned first_new,
+        unsigned n_substrings, unsigned min_length) {
+    std::vector<uint8_t> neighbor(substrings.Size(), 0), shared(n_substrings, 0);
+    for(unsigned w = first_new; w < substrings.Size(); w++) {
+        neighbor[w] = 1;
+        const unsigned L = substrings.Length(w);
+        for(unsigned i = 0; i < L; i++)
+            for(unsigned j = i + min_length; j <= L; j++) {
+                const int id = substrings.Id(w, i, j);
+                if(id >= 0) shared[id] = 1;
+            }
+    }
+    for(unsigned w = 0; w < first_new; w++) {
+        const unsigned L = substrings.Length(w);
+        for(unsigned i = 0; i < L && !neighbor[w]; i++)
+            for(unsigned j = i + min_length; j <= L; j++) {
+                const int id = substrings.Id(w, i, j);
+                if(id >= 0 && shared[id]) {
+                    neighbor[w] = 1;
+                    break;
+                }
+            }
+    }
+    return neighbor;
+}
 
 const std::string FormatSegmentation(const Segmentation& seg,
-        const Vocabulary& substring_vocabulary,
+        const SubstringVocabulary& substring_vocabulary,
         const string morpheme_separator = "^",
         const string prefix_separator = "<",
         const string suffix_separator = ">") {
@@ -25,9 +85,53 @@ const std::string FormatSegmentation(const Segmentation& seg,
 }
 
 int main(int argc, char** argv) {
-    if(argc != 5) {
+    if(argc < 5) {
         std::cerr << "Usage: "
-            << argv[0] << " n_iter alpha_prefix alpha_stem alpha_suffix\n";
+            << argv[0] << " n_iter alpha_prefix alpha_stem alpha_suffix [options]\n"
+            << "Options:\n"
+            << "  --corpus PATH             read the corpus from PATH (default: standard input)\n"
+            << "  --threads N               number of sampling threads (default: all cores)\n"
+            << "  --affinity                pin each sampling thread to its own core\n"
+            << "  --backend native|openfst  lattice implementation (default: native)\n"
+            << "  --check                   compare both backends before and after sampling\n"
+            << "  --type-sampling           build one lattice per word type and iteration\n"
+            << "  --relaxed-counts          shard count totals, synchronized once per iteration\n"
+            << "  --stale-counts            sample against per-thread count snapshots (AD-LDA)\n"
+            << "  --merge-every N           with --stale-counts, merge thread counts every N tokens\n"
+            << "                            (default: 0, at the end of each iteration)\n"
+            << "  --log-every N             report the model summary every N iterations\n"
+            << "                            (default: 10)\n"
+            << "  --checkpoint PATH         save the sampler state to PATH during sampling\n"
+            << "  --checkpoint-every N      save a checkpoint every N iterations (default: 10)\n"
+            << "  --resume PATH             continue sampling from the checkpoint at PATH\n"
+            << "                            (the corpus is not read again)\n"
+            << "  --warm-start PATH         add the corpus to the state saved at PATH and\n"
+            << "                            only sample its tokens\n"
+            << "  --neighborhood N          with --warm-start, also sample the previous tokens\n"
+            << "                            of types sharing N characters or more with a new\n"
+            << "                            type (default: 0, none)\n"
+            << "  --stats PATH              write per-iteration performance counters to PATH\n"
+            << "                            (JSON lines)\n"
+            << "  --max-prefix N            longest prefix, in characters (default: 0, no limit)\n"
+            << "  --max-stem N              longest stem, except for whole words (default: 0)\n"
+            << "  --max-suffix N            longest suffix (default: 0)\n"
+            << "  --min-affix-types N       only use substrings found in N word types or more\n"
+            << "                            as prefixes and suffixes (default: 0)\n"
+            << "  --stop-tolerance T        stop before n_iter once neither the log-likelihood\n"
+            << "                            nor the segmentation change rate improve by more\n"
+            << "                            than a fraction T (default: 0, never)\n"
+            << "  --stop-window N           iterations compared for stopping (default: 20)\n"
+            << "  --anneal T                initial sampling temperature, lowered linearly\n"
+            << "                            to 1 (default: 1, no annealing)\n"
+            << "  --anneal-iterations N     length of the annealing schedule (default: 100)\n"
+            << "  --coordinator ADDRESS     read the corpus and distribute it to --workers N\n"
+            << "                            worker processes listening at ADDRESS\n"
+            << "                            (host:port or unix:path)\n"
+            << "  --workers N               number of worker processes (default: 1)\n"
+            << "  --worker ADDRESS          sample a shard of the corpus received from the\n"
+            << "                            coordinator at ADDRESS\n"
+            << "  --nbest N                 print the N best segmentations of each word\n"
+            << "                            with their log-probabilities\n";
         exit(1);
     }
 
@@ -36,82 +140,536 @@ int main(int argc, char** argv) {
     const float alpha_stem = atof(argv[3]);
     const float alpha_suffix = atof(argv[4]);
 
-    Vocabulary word_vocabulary;
-    Vocabulary substring_vocabulary;
-
-    /* Read vocabulary from standard input */
-    Corpus corpus(std::cin, word_vocabulary);
-    std::cerr << "Read " << corpus.Size() << " sentences, "
-        << corpus.Tokens() << " tokens, "
-        << word_vocabulary.Size() << " types\n";
-
-    /* Create substring tries which are used as a based to build
-     * segmentation lattices */
-    std::vector<Trie> tries;
-    for(const std::string& word: word_vocabulary) {
-        CheckChars(word);
-        Trie trie;
-        for(unsigned i = 0; i <= word.size(); i++) {
-            for(unsigned j = 1; i + j <= word.size(); j++) {
-                const std::string substring = word.substr(i, j);
-                trie.Insert(substring, substring_vocabulary.Encode(substring));
+    Backend backend = NATIVE;
+    bool check_backends = false, type_sampling = false, relaxed_counts = false;
+    bool stale_counts = false, affinity = false;
+    unsigned n_threads = std::thread::hardware_concurrency();
+    unsigned merge_every = 0, log_every = 10, checkpoint_every = 10, nbest = 0;
+    unsigned max_prefix = 0, max_stem = 0, max_suffix = 0, min_affix_types = 0;
+    unsigned stop_window = 20, anneal_iterations = 100, n_workers = 1, neighborhood = 0;
+    double stop_tolerance = 0, anneal = 1;
+    std::string corpus_path, checkpoint_path, resume_path, warm_path, stats_path;
+    std::string coordinator_address, worker_address;
+    for(int i = 5; i < argc; i++) {
+        const std::string option = argv[i];
+        if(option == "--corpus" && i+1 < argc)
+            corpus_path = argv[++i];
+        else if(option == "--threads" && i+1 < argc)
+            n_threads = std::max(1, atoi(argv[++i]));
+        else if(option == "--affinity")
+            affinity = true;
+        else if(option == "--backend" && i+1 < argc) {
+            const std::string name = argv[++i];
+            if(name != "native" && name != "openfst") {
+                std::cerr << "Unknown backend `" << name << "`\n";
+                exit(1);
             }
+            backend = (name == "native") ? NATIVE : OPENFST;
+        }
+        else if(option == "--check")
+            check_backends = true;
+        else if(option == "--type-sampling")
+            type_sampling = true;
+        else if(option == "--relaxed-counts")
+            relaxed_counts = true;
+        else if(option == "--stale-counts")
+            stale_counts = true;
+        else if(option == "--merge-every" && i+1 < argc)
+            merge_every = atoi(argv[++i]);
+        else if(option == "--log-every" && i+1 < argc)
+            log_every = std::max(1, atoi(argv[++i]));
+        else if(option == "--checkpoint" && i+1 < argc)
+            checkpoint_path = argv[++i];
+        else if(option == "--checkpoint-every" && i+1 < argc)
+            checkpoint_every = std::max(1, atoi(argv[++i]));
+        else if(option == "--resume" && i+1 < argc)
+            resume_path = argv[++i];
+        else if(option == "--warm-start" && i+1 < argc)
+            warm_path = argv[++i];
+        else if(option == "--neighborhood" && i+1 < argc)
+            neighborhood = std::max(0, atoi(argv[++i]));
+        else if(option == "--stats" && i+1 < argc)
+            stats_path = argv[++i];
+        else if(option == "--max-prefix" && i+1 < argc)
+            max_prefix = std::max(0, atoi(argv[++i]));
+        else if(option == "--max-stem" && i+1 < argc)
+            max_stem = std::max(0, atoi(argv[++i]));
+        else if(option == "--max-suffix" && i+1 < argc)
+            max_suffix = std::max(0, atoi(argv[++i]));
+        else if(option == "--min-affix-types" && i+1 < argc)
+            min_affix_types = std::max(0, atoi(argv[++i]));
+        else if(option == "--stop-tolerance" && i+1 < argc)
+            stop_tolerance = atof(argv[++i]);
+        else if(option == "--stop-window" && i+1 < argc)
+            stop_window = std::max(2, atoi(argv[++i]));
+        else if(option == "--anneal" && i+1 < argc)
+            anneal = std::max(1.0, atof(argv[++i]));
+        else if(option == "--anneal-iterations" && i+1 < argc)
+            anneal_iterations = std::max(1, atoi(argv[++i]));
+        else if(option == "--nbest" && i+1 < argc)
+            nbest = std::max(1, atoi(argv[++i]));
+        else if(option == "--coordinator" && i+1 < argc)
+            coordinator_address = argv[++i];
+        else if(option == "--workers" && i+1 < argc)
+            n_workers = std::max(1, atoi(argv[++i]));
+        else if(option == "--worker" && i+1 < argc)
+            worker_address = argv[++i];
+        else {
+            std::cerr << "Unknown option `" << option << "`\n";
+            exit(1);
+        }
+    }
+    if((type_sampling || stale_counts) && backend != NATIVE) {
+        std::cerr << "--type-sampling and --stale-counts require the native backend\n";
+        exit(1);
+    }
+    if(type_sampling && stale_counts) {
+        std::cerr << "--type-sampling and --stale-counts cannot be combined\n";
+        exit(1);
+    }
+    const bool coordinator = !coordinator_address.empty(), worker = !worker_address.empty();
+    if(coordinator && worker) {
+        std::cerr << "--coordinator and --worker cannot be combined\n";
+        exit(1);
+    }
+    if(!warm_path.empty() && !resume_path.empty()) {
+        std::cerr << "--warm-start and --resume cannot be combined\n";
+        exit(1);
+    }
+    if((coordinator || worker)
+            && (!checkpoint_path.empty() || !resume_path.empty() || !warm_path.empty())) {
+        std::cerr << "Checkpoints are not supported with --coordinator and --worker\n";
+        exit(1);
+    }
+
+    const MorphemeFilter filter(max_prefix, max_stem, max_suffix, min_affix_types);
+
+    Vocabulary word_vocabulary;
+    SubstringVocabulary substring_vocabulary;
+    ThreadPool pool(n_threads);
+    if(affinity && !pool.pin())
+        std::cerr << "Could not set thread affinity, threads are not pinned\n";
+    SubstringTable substrings;
+    std::vector<unsigned> tokens;
+
+    /* Settings which must match those of a checkpoint or of the coordinator */
+    const Checkpoint::Info settings = {0, alpha_prefix, alpha_stem, alpha_suffix,
+        max_prefix, max_stem, max_suffix, min_affix_types, 0};
+    auto check_settings = [&settings] (const Checkpoint::Info& info, const std::string& source) {
+        if(info.alpha_prefix != settings.alpha_prefix || info.alpha_stem != settings.alpha_stem
+                || info.alpha_suffix != settings.alpha_suffix) {
+            std::cerr << source << " with alphas "
+                << info.alpha_prefix << " " << info.alpha_stem << " "
+                << info.alpha_suffix << "\n";
+            exit(1);
+        }
+        if(info.max_prefix != settings.max_prefix || info.max_stem != settings.max_stem
+                || info.max_suffix != settings.max_suffix
+                || info.min_affix_types != settings.min_affix_types) {
+            std::cerr << source << " with --max-prefix "
+                << info.max_prefix << " --max-stem " << info.max_stem
+                << " --max-suffix " << info.max_suffix
+                << " --min-affix-types " << info.min_affix_types << "\n";
+            exit(1);
         }
-        tries.push_back(trie);
+    };
+
+    std::unique_ptr<Checkpoint> checkpoint;
+    std::unique_ptr<ShardWorker> shard_worker;
+    unsigned first_iteration = 0;
+    size_t n_old_tokens = 0; // with --warm-start, tokens of the previous run
+    unsigned n_old_types = 0;
+    if(!warm_path.empty()) {
+        /* Extend the state of a previous run with the types, substrings and
+         * tokens of the new corpus; iterations start over */
+        checkpoint.reset(new Checkpoint(warm_path));
+        check_settings(checkpoint->GetInfo(), "Checkpoint `" + warm_path + "` was sampled");
+        checkpoint->LoadVocabularies(word_vocabulary, substring_vocabulary, substrings);
+        checkpoint->LoadTokens(tokens);
+        n_old_tokens = tokens.size();
+        n_old_types = word_vocabulary.Size();
+        const unsigned n_old_substrings = substring_vocabulary.Size();
+        Corpus corpus(corpus_path, word_vocabulary, pool);
+        tokens.insert(tokens.end(), corpus.TokenIds().begin(), corpus.TokenIds().end());
+        for(unsigned w = n_old_types; w < word_vocabulary.Size(); w++) {
+            const std::string& word = word_vocabulary.Convert(w);
+            CheckUtf8(word);
+            substrings.Add(word, substring_vocabulary, filter.MaxSubstringLength());
+        }
+        std::cerr << "Warm start from `" << warm_path << "`: read "
+            << tokens.size() - n_old_tokens << " tokens, "
+            << word_vocabulary.Size() - n_old_types << " new types, "
+            << substring_vocabulary.Size() - n_old_substrings << " new substrings\n";
+    }
+    else if(!resume_path.empty()) {
+        /* Restore vocabularies and substrings from a previous run */
+        checkpoint.reset(new Checkpoint(resume_path));
+        const Checkpoint::Info& info = checkpoint->GetInfo();
+        check_settings(info, "Checkpoint `" + resume_path + "` was sampled");
+        first_iteration = info.iteration;
+        checkpoint->LoadVocabularies(word_vocabulary, substring_vocabulary, substrings);
+        checkpoint->LoadTokens(tokens);
+        std::cerr << "Resuming after iteration " << first_iteration << ": "
+            << word_vocabulary.Size() << " types, "
+            << substring_vocabulary.Size() << " substrings\n";
+    }
+    else if(worker) {
+        /* Receive the word types and a shard of the tokens */
+        shard_worker.reset(new ShardWorker(worker_address));
+        check_settings(shard_worker->ReceiveShard(word_vocabulary, tokens),
+                "The coordinator samples");
+        substrings.Build(word_vocabulary, substring_vocabulary, pool,
+                filter.MaxSubstringLength());
+        shard_worker->SendSubstrings(substrings, substring_vocabulary.Size());
+        std::cerr << "Received " << tokens.size() << " tokens, "
+            << word_vocabulary.Size() << " types\n";
     }
+    else {
+        /* Read vocabulary from the corpus file or standard input */
+        Corpus corpus(corpus_path, word_vocabulary, pool);
+        std::cerr << "Read " << corpus.Size() << " sentences, "
+            << corpus.Tokens() << " tokens, "
+            << word_vocabulary.Size() << " types\n";
+        tokens = corpus.TokenIds();
 
-    std::cerr << "Found " << substring_vocabulary.Size() << " substrings\n";
+        /* Encode all substrings of each word that can be morphemes, which are
+         * used as a basis to build segmentation lattices */
+        for(const std::string& word: word_vocabulary)
+            CheckUtf8(word);
+        substrings.Build(word_vocabulary, substring_vocabulary, pool,
+                filter.MaxSubstringLength());
+
+        std::cerr << "Found " << substring_vocabulary.Size() << " substrings\n";
+    }
+
+    /* The coordinator hands the tokens out to the workers and only keeps
+     * the global counts */
+    const size_t n_tokens = tokens.size();
+    std::unique_ptr<ShardCoordinator> shard_coordinator;
+    if(coordinator) {
+        std::cerr << "Waiting for " << n_workers << " workers at " << coordinator_address << "\n";
+        shard_coordinator.reset(new ShardCoordinator(coordinator_address, n_workers));
+        shard_coordinator->SendShards(settings, word_vocabulary, tokens, substrings,
+                substring_vocabulary.Size());
+        std::vector<unsigned>().swap(tokens);
+    }
 
     /* Initialize segmentation model */
     SegmentationModel model(alpha_prefix, alpha_stem, alpha_suffix,
-           word_vocabulary, substring_vocabulary.Size(), tries);
+           word_vocabulary, substring_vocabulary.Size(), substrings, backend,
+           relaxed_counts);
+    model.filter = filter;
+    model.filter.PruneAffixes(substrings, substring_vocabulary.Size());
 
+    /* One random engine and lattice chart per worker thread */
     std::random_device rd;
     std::mt19937 engine(rd());
+    std::vector<std::mt19937> engines;
+    for(unsigned k = 0; k < pool.size(); k++)
+        engines.emplace_back(rd());
+    std::vector<Chart> charts(pool.size());
+
+    /* Current segmentation of each token, and per-thread scratch space for
+     * the segmentations being updated */
+    SegmentationStore segs(substrings, tokens);
+    std::vector<Segmentation> current(pool.size()), sampled(pool.size());
+
+    Chart chart;
+    if(checkpoint) {
+        checkpoint->LoadState(segs, model, engines);
+        checkpoint.reset();
+        /* Initialize new tokens from the model of the previous run */
+        if(!warm_path.empty()) {
+            for(size_t i = n_old_tokens; i < tokens.size(); i++) {
+                model.Increment(tokens[i], engine, chart, current[0]);
+                segs.Set(i, current[0]);
+            }
+            model.Synchronize();
+        }
+    }
+    else {
+        /* Obtain initial random segmentations */
+        for(size_t i = 0; i < tokens.size(); i++) {
+            model.Increment(tokens[i], engine, chart, current[0], true);
+            segs.Set(i, current[0]);
+        }
+        model.Synchronize();
+    }
+    if(coordinator)
+        shard_coordinator->Exchange(model);
+    else if(worker)
+        shard_worker->Exchange(model, CountDelta(), 0);
+
+    if(check_backends)
+        model.CheckBackends(std::cerr);
 
-    std::vector<Segmentation> segs;
+    /* Tokens to sample: all of them, or with --warm-start the new tokens and
+     * the previous tokens of neighboring types */
+    const unsigned n_types = word_vocabulary.Size();
+    std::vector<uint8_t> neighbor;
+    if(!warm_path.empty())
+        neighbor = (neighborhood > 0)
+            ? Neighbors(substrings, n_old_types, substring_vocabulary.Size(), neighborhood)
+            : std::vector<uint8_t>(n_types, 0);
+    auto sampled_token = [&] (size_t i) {
+        return warm_path.empty() || i >= n_old_tokens || neighbor[tokens[i]];
+    };
+
+    /* Group sampled token indices by word type: type_tokens[type_start[w]..type_start[w+1]) */
+    std::vector<unsigned> type_start(n_types + 1, 0), type_tokens;
+    for(size_t i = 0; i < tokens.size(); i++)
+        if(sampled_token(i)) type_start[tokens[i]+1]++;
+    for(unsigned w = 0; w < n_types; w++)
+        type_start[w+1] += type_start[w];
+    type_tokens.resize(type_start[n_types]);
+    std::vector<unsigned> next(type_start.begin(), type_start.end() - 1);
+    for(unsigned i = 0; i < tokens.size(); i++)
+        if(sampled_token(i)) type_tokens[next[tokens[i]]++] = i;
+    const size_t n_sampled = type_tokens.size();
+    if(!warm_path.empty())
+        std::cerr << "Sampling " << n_sampled << " of " << tokens.size() << " tokens\n";
+
+    /* Schedule the tokens (or the word types) of an iteration by decreasing
+     * estimated cost, in chunks of balanced cost */
+    const size_t n_chunks = 16 * pool.size();
+    std::vector<double> costs(n_types);
+    for(unsigned w = 0; w < n_types; w++)
+        costs[w] = LatticeCost(model.filter, substrings.Length(w));
+    Schedule schedule;
+    if(type_sampling) {
+        // One lattice per type, then a Metropolis-Hastings step per token
+        std::vector<unsigned> start(n_types + 1, 0), types;
+        for(unsigned w = 0; w < n_types; w++) {
+            const unsigned n = type_start[w+1] - type_start[w];
+            if(n > 0) types.push_back(w);
+            start[w+1] = types.size();
+            costs[w] += n * (2 * substrings.Length(w) + 4);
+        }
+        schedule = Schedule(costs, start, types, n_chunks);
+    }
+    else
+        schedule = Schedule(costs, type_start, type_tokens, n_chunks);
 
-    /* Obtain initial random segmentations */
-    unsigned wid = 0;
-    for(auto& sentence: corpus) {
-        for(auto& word: sentence) {
-            const Segmentation seg = model.Increment(word, engine, true);
-            segs.push_back(seg);
-            wid++;
+    /* Per-thread performance counters, reported every iteration */
+    std::vector<ThreadStats> stats(pool.size());
+    std::ofstream stats_file;
+    if(!stats_path.empty()) {
+        stats_file.open(stats_path);
+        if(!stats_file) {
+            std::cerr << "Could not open `" << stats_path << "`\n";
+            exit(1);
         }
+        for(unsigned k = 0; k < pool.size(); k++)
+            charts[k].stats = &stats[k];
     }
 
+    /* Per-thread pending count changes for the stale-count sampler */
+    std::vector<SegmentationWorker> workers;
+    std::vector<unsigned> since_merge(pool.size(), 0);
+    if(stale_counts)
+        for(unsigned k = 0; k < pool.size(); k++)
+            workers.emplace_back(model);
+
     std::cerr << "Initialization done \n"
-        << "Running parallel Gibbs sampler with " << NTHREADS << " threads\n";
+        << "Running " << (stale_counts ? "approximate " : "")
+        << "parallel Gibbs sampler with " << pool.size() << " threads\n";
+    if(coordinator)
+        std::cerr << "Tokens are sampled by " << n_workers << " worker processes\n";
 
     /* Run Gibbs sampler */
-    for(unsigned it = 0; it < n_iterations; it++) {
-        wid = 0;
-        ThreadPool pool(NTHREADS);
-        for(auto& sentence: corpus) {
-            for(auto word: sentence) {
-                pool.enqueue([&model, &engine, &segs, wid, word] {
-                model.Decrement(word, segs[wid]);
-                segs[wid] = model.Increment(word, engine, false);
-                });
-                wid++;
-            }
+    std::atomic<unsigned> moves(0), accepted(0);
+    std::vector<ChangeCount> changes(pool.size());
+    std::vector<double> lls, change_rates; // after annealing, for stopping
+    for(unsigned it = first_iteration; worker || it < n_iterations; it++) {
+        const auto start = std::chrono::steady_clock::now();
+        model.temperature = (it < anneal_iterations)
+            ? anneal + (1 - anneal) * it / anneal_iterations : 1;
+        // Workers follow the iterations and temperatures of the coordinator
+        CountDelta before;
+        if(coordinator)
+            shard_coordinator->Broadcast({0, it, model.temperature});
+        else if(worker) {
+            const Command command = shard_worker->ReceiveCommand();
+            if(command.stop) break;
+            it = command.iteration;
+            model.temperature = command.temperature;
+            before = CountDelta(model);
         }
-        pool.join();
+        for(auto& c: changes)
+            c.n = 0;
+        const double count_wait = model.CountWaitSeconds();
+        for(auto& s: stats)
+            s.Reset();
+        pool.reset_busy();
+        if(type_sampling)
+            schedule.Enqueue(pool,
+                    [&model, &engines, &charts, &segs, &type_start, &type_tokens,
+                    &moves, &accepted, &changes] (unsigned w, unsigned thread) {
+                const unsigned n = type_start[w+1] - type_start[w];
+                moves += n;
+                accepted += model.IncrementType(w, &type_tokens[type_start[w]], n,
+                        segs, engines[thread], charts[thread], changes[thread].n);
+            });
+        else if(stale_counts)
+            schedule.Enqueue(pool,
+                    [&workers, &since_merge, merge_every, &engines, &charts, &segs, &tokens,
+                    &current, &sampled, &changes] (unsigned i, unsigned thread) {
+                SegmentationWorker& worker = workers[thread];
+                ThreadStats* stats = charts[thread].stats;
+                if(stats) stats->Start();
+                segs.Get(i, current[thread]);
+                worker.Decrement(tokens[i], current[thread]);
+                if(stats) stats->Lap(stats->update);
+                worker.Increment(tokens[i], engines[thread], charts[thread], sampled[thread]);
+                if(segs.Set(i, sampled[thread])) changes[thread].n++;
+                if(merge_every > 0 && ++since_merge[thread] >= merge_every) {
+                    worker.Merge();
+                    since_merge[thread] = 0;
+                }
+            });
+        else
+            schedule.Enqueue(pool,
+                    [&model, &engines, &charts, &segs, &tokens, &current, &sampled, &changes]
+                    (unsigned i, unsigned thread) {
+                ThreadStats* stats = charts[thread].stats;
+                if(stats) stats->Start();
+                segs.Get(i, current[thread]);
+                model.Decrement(tokens[i], current[thread]);
+                if(stats) stats->Lap(stats->update);
+                model.Increment(tokens[i], engines[thread], charts[thread], sampled[thread]);
+                if(segs.Set(i, sampled[thread])) changes[thread].n++;
+            });
+        pool.wait();
+        for(auto& w: workers)
+            w.Merge();
+        model.Synchronize();
+        size_t n_changed = 0;
+        for(auto& c: changes)
+            n_changed += c.n;
+        if(coordinator)
+            n_changed = shard_coordinator->Exchange(model);
+        else if(worker)
+            shard_worker->Exchange(model, before, n_changed);
 
-        if(it % 10 == 0) {
+        // The log-likelihood is maintained incrementally, so it is cheap to report;
+        // every token of the corpus has one stem, including on workers
+        const double ll = model.LogLikelihood();
+        const double ppl = exp(-ll/model.stem_model.Total());
+        // Workers report the changes of their own shard, warm starts those of
+        // the tokens being sampled
+        const size_t n_changeable = coordinator ? n_tokens : n_sampled;
+        const double change_rate = (double) n_changed / std::max<size_t>(1, n_changeable);
+        double busy_total = 0, busy_max = 0;
+        size_t n_stolen = 0;
+        for(unsigned k = 0; k < pool.size(); k++) {
+            busy_total += pool.busy_seconds(k);
+            busy_max = std::max(busy_max, pool.busy_seconds(k));
+            n_stolen += pool.tasks_stolen(k);
+        }
+        // Slowest thread relative to the mean: 1 when the load is balanced
+        const double imbalance = (busy_total > 0) ? busy_max * pool.size() / busy_total : 1;
+        if(it % log_every == 0) {
             std::cerr << "Iteration " << (it+1) << "/" << n_iterations << "\n";
             std::cerr << model << "\n";
-            double ll = model.LogLikelihood();
-            double ppl = exp(-ll/corpus.Tokens());
-            std::cerr << "LL=" << ll << " ppl=" << ppl << "\n";
+            std::cerr << "Thread load: imbalance " << imbalance << ", "
+                << n_stolen << "/" << schedule.Chunks() << " chunks stolen\n";
+            if(type_sampling) {
+                std::cerr << "Type moves accepted: " << accepted << "/" << moves << "\n";
+                moves = 0;
+                accepted = 0;
+            }
+        }
+        std::cerr << "Iteration " << (it+1) << " LL=" << ll << " ppl=" << ppl
+            << " changed=" << change_rate;
+        if(model.temperature != 1)
+            std::cerr << " T=" << model.temperature;
+        std::cerr << "\n";
+
+        // Stop on convergence, judged on untempered iterations only
+        bool converged = false;
+        if(stop_tolerance > 0 && model.temperature == 1 && !worker) {
+            lls.push_back(ll);
+            change_rates.push_back(change_rate);
+            converged = Converged(lls, change_rates, stop_window, stop_tolerance);
+        }
+
+        if(stats_file.is_open()) {
+            const double seconds = std::chrono::duration<double>(
+                    std::chrono::steady_clock::now() - start).count();
+            ThreadStats total;
+            for(auto& s: stats)
+                total.Merge(s);
+            stats_file << "{\"iteration\": " << (it+1) << ", \"seconds\": " << seconds
+                << ", \"build\": " << total.build << ", \"sample\": " << total.sample
+                << ", \"update\": " << total.update << ", \"tokens\": " << total.tokens
+                << ", \"tokens_per_second\": " << total.tokens / seconds
+                << ", \"count_wait\": " << model.CountWaitSeconds() - count_wait
+                << ", \"ll\": " << ll << ", \"changed\": " << change_rate
+                << ", \"temperature\": " << model.temperature
+                << ", \"imbalance\": " << imbalance << ", \"threads\": [";
+            for(unsigned k = 0; k < pool.size(); k++)
+                stats_file << (k ? ", " : "") << "{\"busy\": " << pool.busy_seconds(k)
+                    << ", \"utilization\": " << pool.busy_seconds(k) / seconds
+                    << ", \"tokens\": " << stats[k].tokens
+                    << ", \"chunks\": " << pool.tasks_run(k)
+                    << ", \"stolen\": " << pool.tasks_stolen(k) << "}";
+            stats_file << "], \"lattices\": ";
+            total.WriteLattices(stats_file);
+            stats_file << "}" << std::endl;
+        }
+
+        if(!checkpoint_path.empty()
+                && ((it+1) % checkpoint_every == 0 || it+1 == n_iterations || converged)) {
+            const Checkpoint::Info info = {it+1, alpha_prefix, alpha_stem, alpha_suffix,
+                max_prefix, max_stem, max_suffix, min_affix_types, 0};
+            Checkpoint::Save(checkpoint_path, info, word_vocabulary, substring_vocabulary,
+                    substrings, tokens, segs, model, engines);
+        }
+
+        if(converged) {
+            std::cerr << "Converged after iteration " << (it+1) << "\n";
+            break;
         }
     }
 
-    /* Print final segmentations decoded with Viterbi algorithm */
-    for(unsigned w = 0; w < word_vocabulary.Size(); w++) {
-        const std::string& word = word_vocabulary.Convert(w);
-        const Segmentation seg = model.Decode(w);
-        std::cout << word << "\t" << FormatSegmentation(seg, substring_vocabulary) << "\n";
+    if(coordinator)
+        shard_coordinator->Broadcast({1, 0, 1});
+    if(worker)
+        return 0;
+
+    if(check_backends)
+        model.CheckBackends(std::cerr);
+
+    /* Print final segmentations decoded with Viterbi algorithm: blocks of
+     * word types are decoded in parallel and written in order */
+    const unsigned block_size = 1 << 14;
+    std::vector<std::string> lines(block_size);
+    std::string output;
+    for(unsigned start = 0; start < word_vocabulary.Size(); start += block_size) {
+        const unsigned end = std::min<size_t>(start + block_size, word_vocabulary.Size());
+        pool.enqueue_range(start, end,
+                [&model, &word_vocabulary, &substring_vocabulary, &charts, &lines, start, nbest]
+                (size_t w, unsigned thread) {
+            const std::string& word = word_vocabulary.Convert(w);
+            std::string& line = lines[w - start];
+            line.clear();
+            if(nbest == 0) {
+                const Segmentation seg = model.Decode(w, charts[thread]);
+                line += word + "\t" + FormatSegmentation(seg, substring_vocabulary) + "\n";
+                return;
+            }
+            std::vector<Segmentation> segs;
+            std::vector<double> scores;
+            const unsigned n = model.Decode(w, nbest, charts[thread], segs, scores);
+            for(unsigned k = 0; k < n; k++)
+                line += word + "\t" + FormatSegmentation(segs[k], substring_vocabulary)
+                    + "\t" + std::to_string(scores[k]) + "\n";
+        });
+        pool.wait();
+        output.clear();
+        for(unsigned w = start; w < end; w++)
+            output += lines[w - start];
+        fwrite(output.data(), 1, output.size(), stdout);
     }
+    fflush(stdout);
 }
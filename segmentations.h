@@ -0,0 +1,123 @@
+#include <vector>
+#include <cstdint>
+#include <cassert>
+
+struct Segmentation {
+    vector<unsigned> prefixes, suffixes;
+    unsigned stem;
+
+    bool operator==(const Segmentation& other) const {
+        return stem == other.stem && prefixes == other.prefixes
+            && suffixes == other.suffixes;
+    }
+
+    bool operator!=(const Segmentation& other) const {
+        return !(*this == other);
+    }
+};
+
+/* Current segmentations of all the tokens of the corpus, in compact form
+ * A segmentation of a word of L characters is determined by its morpheme
+ * boundaries and its stem span. For words of up to 53 characters these fit
+ * in one 64-bit code: stem start and end positions in the low 12 bits (6
+ * bits each) and a bitmask of the boundaries at positions 1..L-1 above them.
+ * Segmentations of longer words are kept in full in a side array, and their
+ * code is their index in it. Codes are rewritten in place, so updating the
+ * segmentation of a token allocates nothing; they are decoded to substring
+ * ids on demand. Distinct tokens can be read and written concurrently. */
+
+class SegmentationStore {
+    static const unsigned max_code_length = 53;
+
+    const SubstringTable& substrings;
+    const std::vector<unsigned>& tokens;
+    std::vector<uint64_t> codes;
+    std::vector<Segmentation> long_segs; // of words longer than max_code_length
+
+    /* Position after the morpheme of id `id` starting at position i of
+     * word type `w`: substrings of a row of the table have distinct ids */
+    unsigned End(unsigned w, unsigned i, unsigned id) const {
+        const unsigned L = substrings.Length(w);
+        const int* row = substrings.Ids(w) + SubstringTable::Index(L, i, i+1);
+        unsigned j = i+1;
+        while(j < L && row[j-i-1] != (int) id) j++;
+        assert(row[j-i-1] == (int) id);
+        return j;
+    }
+
+    uint64_t Encode(unsigned w, const Segmentation& seg) const {
+        const unsigned L = substrings.Length(w);
+        uint64_t mask = 0;
+        unsigned i = 0;
+        for(unsigned p: seg.prefixes) {
+            i = End(w, i, p);
+            mask |= 1ull << (i-1);
+        }
+        const unsigned start = i;
+        i = End(w, i, seg.stem);
+        const unsigned end = i;
+        if(end < L) mask |= 1ull << (end-1);
+        for(unsigned s: seg.suffixes) {
+            i = End(w, i, s);
+            if(i < L) mask |= 1ull << (i-1);
+        }
+        return (mask << 12) | (end << 6) | start;
+    }
+
+    void Decode(unsigned w, uint64_t code, Segmentation& seg) const {
+        const unsigned L = substrings.Length(w);
+        const unsigned start = code & 63, end = (code >> 6) & 63;
+        uint64_t mask = (code >> 12) | (1ull << (L-1)); // with the word end
+        seg.prefixes.clear();
+        seg.suffixes.clear();
+        unsigned i = 0;
+        while(mask) {
+            const unsigned j = __builtin_ctzll(mask) + 1;
+            mask &= mask - 1;
+            const unsigned id = substrings.Id(w, i, j);
+            if(j <= start) seg.prefixes.push_back(id);
+            else if(j == end) seg.stem = id;
+            else seg.suffixes.push_back(id);
+            i = j;
+        }
+    }
+
+    public:
+    /* Storage for the segmentations of `tokens`, which must not change */
+    SegmentationStore(const SubstringTable& substrings, const std::vector<unsigned>& tokens)
+        : substrings(substrings), tokens(tokens), codes(tokens.size()), long_segs() {
+        for(size_t i = 0; i < tokens.size(); i++)
+            if(substrings.Length(tokens[i]) > max_code_length) {
+                codes[i] = long_segs.size();
+                long_segs.emplace_back();
+            }
+    }
+
+    /* Decode the segmentation of token i into `seg`, reusing its storage */
+    void Get(size_t i, Segmentation& seg) const {
+        const unsigned w = tokens[i];
+        if(substrings.Length(w) > max_code_length)
+            seg = long_segs[codes[i]];
+        else
+            Decode(w, codes[i], seg);
+    }
+
+    /* Set the segmentation of token i; returns whether it changed */
+    bool Set(size_t i, const Segmentation& seg) {
+        const unsigned w = tokens[i];
+        if(substrings.Length(w) > max_code_length) {
+            Segmentation& old = long_segs[codes[i]];
+            if(old == seg) return false;
+            old = seg;
+            return true;
+        }
+        const uint64_t code = Encode(w, seg);
+        if(code == codes[i]) return false;
+        codes[i] = code;
+        return true;
+    }
+
+    size_t Size() const {
+        return codes.size();
+    }
+};
@@ -0,0 +1,204 @@
+#include <fst/fstlib.h>
+#include <thread>
+#include <list>
+#include <cstdio>
+#include "thread_pool.h"
+#include "utf8.h"
+#include "stats.h"
+#include "vocabulary.h"
+#include "prob.h"
+#include "substrings.h"
+#include "morphemes.h"
+#include "segmentations.h"
+#include "banana.h"
+#include "chart.h"
+#include "pss_model.h"
+#include "checkpoint.h"
+
+/* Segment new words with a trained model
+ * The model (substring vocabulary and counts) is loaded from a checkpoint
+ * written by `segment --checkpoint`. Words are read from standard input, one
+ * per line, and printed with their Viterbi segmentation in the same format
+ * as the output of `segment`. Input is processed in batches: words found in
+ * an LRU cache of recent results are answered directly, and the distinct
+ * remaining words of the batch are decoded in parallel. */
+
+class LruCache {
+    typedef std::list< std::pair<std::string, std::string> > List;
+    List entries; // most recently used first
+    std::unordered_map<std::string, List::iterator> index;
+    size_t capacity;
+
+    public:
+    LruCache(size_t capacity) : entries(), index(), capacity(capacity) {}
+
+    /* Cached value for `key` (nullptr if absent), which becomes the most recent */
+    const std::string* Get(const std::string& key) {
+        auto it = index.find(key);
+        if(it == index.end()) return nullptr;
+        entries.splice(entries.begin(), entries, it->second);
+        return &it->second->second;
+    }
+
+    void Put(const std::string& key, const std::string& value) {
+        if(capacity == 0 || index.count(key)) return;
+        if(entries.size() >= capacity) {
+            index.erase(entries.back().first);
+            entries.pop_back();
+        }
+        entries.emplace_front(key, value);
+        index[key] = entries.begin();
+    }
+};
+
+/* Scratch space of a decoding thread */
+struct Buffers {
+    std::vector<int> ids, labels;
+    std::vector<unsigned> bounds;
+    Chart chart;
+};
+
+/* Viterbi segmentation of `word`; substrings outside the vocabulary get ids
+ * K + their position in the triangular array, which have a zero count.
+ * Words that are not valid UTF-8 are left unsegmented */
+std::string Segment(const std::string& word, const SegmentationModel& model,
+        const SubstringVocabulary& substring_vocabulary, Buffers& buffers) {
+    if(word.empty()) return "";
+    if(!ValidUtf8(word.data(), word.size())) return "<" + word + ">";
+    std::vector<int>& ids = buffers.ids;
+    std::vector<unsigned>& b = buffers.bounds;
+    buffers.labels.clear();
+    b.clear();
+    const unsigned L = DecodeUtf8(word.data(), word.size(), buffers.labels, b);
+    const unsigned K = substring_vocabulary.Size();
+    const unsigned max_length = model.filter.MaxSubstringLength();
+    ids.resize(L * (L + 1) / 2);
+    for(unsigned i = 0; i < L; i++)
+        for(unsigned j = i+1; j <= L; j++) {
+            const unsigned s = SubstringTable::Index(L, i, j);
+            const int k = SubstringTable::Kept(L, i, j, max_length)
+                ? substring_vocabulary.Find(word.data() + b[i], b[j] - b[i]) : -1;
+            ids[s] = (k >= 0) ? k : K + s;
+        }
+    const Segmentation seg = model.Decode(L, ids.data(), buffers.chart);
+
+    // Read the morphemes off the word: each one is the span starting at the
+    // current position whose id matches
+    unsigned i = 0;
+    auto morpheme = [&] (unsigned id) {
+        unsigned j = i+1;
+        while(j < L && ids[SubstringTable::Index(L, i, j)] != (int) id) j++;
+        const std::string m = word.substr(b[i], b[j] - b[i]);
+        i = j;
+        return m;
+    };
+    std::string res;
+    for(unsigned p: seg.prefixes)
+        res += morpheme(p) + "^";
+    res += "<" + morpheme(seg.stem) + ">";
+    for(unsigned s: seg.suffixes)
+        res += "^" + morpheme(s);
+    return res;
+}
+
+int main(int argc, char** argv) {
+    if(argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " checkpoint [options] < words > segmentations\n"
+            << "Options:\n"
+            << "  --threads N  number of decoding threads (default: all cores)\n"
+            << "  --batch N    words read per batch (default: 65536)\n"
+            << "  --cache N    number of cached segmentations (default: 1000000)\n";
+        exit(1);
+    }
+
+    unsigned n_threads = std::thread::hardware_concurrency();
+    size_t batch_size = 65536, cache_size = 1000000;
+    for(int i = 2; i < argc; i++) {
+        const std::string option = argv[i];
+        if(option == "--threads" && i+1 < argc)
+            n_threads = std::max(1, atoi(argv[++i]));
+        else if(option == "--batch" && i+1 < argc)
+            batch_size = std::max(1, atoi(argv[++i]));
+        else if(option == "--cache" && i+1 < argc)
+            cache_size = atol(argv[++i]);
+        else {
+            std::cerr << "Unknown option `" << option << "`\n";
+            exit(1);
+        }
+    }
+
+    /* Load the trained model */
+    Vocabulary word_vocabulary;
+    SubstringVocabulary substring_vocabulary;
+    SubstringTable substrings;
+    Checkpoint checkpoint(argv[1]);
+    const Checkpoint::Info& info = checkpoint.GetInfo();
+    checkpoint.LoadVocabularies(word_vocabulary, substring_vocabulary, substrings);
+    SegmentationModel model(info.alpha_prefix, info.alpha_stem, info.alpha_suffix,
+            word_vocabulary, substring_vocabulary.Size(), substrings);
+    model.filter = MorphemeFilter(info.max_prefix, info.max_stem, info.max_suffix,
+            info.min_affix_types);
+    model.filter.PruneAffixes(substrings, substring_vocabulary.Size());
+    checkpoint.LoadModel(model);
+    std::cerr << "Loaded model after " << info.iteration << " iterations: "
+        << substring_vocabulary.Size() << " substrings\n";
+
+    ThreadPool pool(n_threads);
+    std::vector<Buffers> buffers(pool.size());
+    LruCache cache(cache_size);
+
+    std::vector<std::string> batch;
+    std::vector<int> miss; // index in `words` of each cache miss, -1 for hits
+    std::vector<std::string> hits, words, results;
+    std::unordered_map<std::string, unsigned> batch_index;
+    std::string output, line;
+    size_t n_words = 0, n_decoded = 0;
+    while(std::cin) {
+        /* Read a batch and look it up in the cache */
+        batch.clear();
+        while(batch.size() < batch_size && getline(std::cin, line))
+            batch.push_back(line);
+        hits.resize(batch.size());
+        miss.assign(batch.size(), -1);
+        words.clear();
+        batch_index.clear();
+        for(size_t i = 0; i < batch.size(); i++) {
+            const std::string* cached = cache.Get(batch[i]);
+            if(cached) {
+                hits[i] = *cached;
+                continue;
+            }
+            auto it = batch_index.find(batch[i]);
+            if(it == batch_index.end()) {
+                it = batch_index.insert(std::make_pair(batch[i], words.size())).first;
+                words.push_back(batch[i]);
+            }
+            miss[i] = it->second;
+        }
+
+        /* Decode the distinct new words */
+        results.resize(words.size());
+        pool.enqueue_range(0, words.size(),
+                [&] (size_t k, unsigned thread) {
+            results[k] = Segment(words[k], model, substring_vocabulary, buffers[thread]);
+        });
+        pool.wait();
+        for(size_t k = 0; k < words.size(); k++)
+            cache.Put(words[k], results[k]);
+
+        /* Write the batch in input order */
+        output.clear();
+        for(size_t i = 0; i < batch.size(); i++) {
+            output += batch[i];
+            output += '\t';
+            output += (miss[i] < 0) ? hits[i] : results[miss[i]];
+            output += '\n';
+        }
+        fwrite(output.data(), 1, output.size(), stdout);
+        n_words += batch.size();
+        n_decoded += words.size();
+    }
+    fflush(stdout);
+    std::cerr << "Segmented " << n_words << " words ("
+        << n_decoded << " decoded, " << (n_words - n_decoded) << " reused)\n";
+}
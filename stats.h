@@ -0,0 +1,89 @@
+#include <vector>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+
+/* Performance counters of one sampling thread
+ * Each thread owns its counters (no synchronization): time is split between
+ * lattice construction, sampling from the lattice and count updates, and
+ * lattice sizes are accumulated by word length (in characters). Sampling
+ * code only touches them through a pointer which is null when telemetry is
+ * disabled, so the cost is a few clock reads per token when it is enabled. */
+
+struct ThreadStats {
+    typedef std::chrono::steady_clock Clock;
+
+    double build, sample, update; // seconds
+    uint64_t tokens;
+    std::vector<uint64_t> lattices, states, arcs; // indexed by word length
+    Clock::time_point last;
+
+    ThreadStats() {
+        Reset();
+    }
+
+    void Reset() {
+        build = sample = update = 0;
+        tokens = 0;
+        lattices.clear();
+        states.clear();
+        arcs.clear();
+        last = Clock::now();
+    }
+
+    /* Start timing a new stage */
+    void Start() {
+        last = Clock::now();
+    }
+
+    /* Add the time elapsed since the last lap to `timer` */
+    void Lap(double& timer) {
+        const Clock::time_point now = Clock::now();
+        timer += std::chrono::duration<double>(now - last).count();
+        last = now;
+    }
+
+    void AddLattice(unsigned length, uint64_t n_states, uint64_t n_arcs) {
+        if(lattices.size() <= length) {
+            lattices.resize(length + 1);
+            states.resize(length + 1);
+            arcs.resize(length + 1);
+        }
+        lattices[length]++;
+        states[length] += n_states;
+        arcs[length] += n_arcs;
+    }
+
+    /* Accumulate the counters of another thread */
+    void Merge(const ThreadStats& other) {
+        build += other.build;
+        sample += other.sample;
+        update += other.update;
+        tokens += other.tokens;
+        if(lattices.size() < other.lattices.size()) {
+            lattices.resize(other.lattices.size());
+            states.resize(other.lattices.size());
+            arcs.resize(other.lattices.size());
+        }
+        for(unsigned length = 0; length < other.lattices.size(); length++) {
+            lattices[length] += other.lattices[length];
+            states[length] += other.states[length];
+            arcs[length] += other.arcs[length];
+        }
+    }
+
+    /* Lattice sizes as a JSON array of {length, count, mean states, mean arcs} */
+    void WriteLattices(std::ostream& out) const {
+        out << "[";
+        bool first = true;
+        for(unsigned length = 0; length < lattices.size(); length++) {
+            if(lattices[length] == 0) continue;
+            out << (first ? "" : ", ") << "{\"length\": " << length
+                << ", \"count\": " << lattices[length]
+                << ", \"states\": " << (double) states[length] / lattices[length]
+                << ", \"arcs\": " << (double) arcs[length] / lattices[length] << "}";
+            first = false;
+        }
+        out << "]";
+    }
+};
@@ -0,0 +1,138 @@
+#include <vector>
+#include <string>
+#include <cassert>
+#include <algorithm>
+
+/* Substring ids of every word type, stored in one contiguous arena
+ * Positions are character (UTF-8 code point) positions: for a word of L
+ * characters, the ids of the substrings word[i:j] (0 <= i < j <= L) are laid
+ * out row by row in a triangular array of L(L+1)/2 entries:
+ * row i holds word[i:i+1], word[i:i+2], ..., word[i:L]
+ * The character labels and byte bounds of each word (utf8.h) are kept in
+ * two more arrays of L+1 entries per word. Substrings longer than a maximum
+ * morpheme length (morphemes.h), other than the whole word, get id -1. */
+
+class SubstringTable {
+    std::vector<unsigned> offsets; // start of each word in the arena
+    std::vector<unsigned> lengths; // in characters
+    std::vector<int> arena;
+    std::vector<unsigned> char_offsets; // start of each word in labels and bounds
+    std::vector<int> labels; // L labels and a padding 0 per word
+    std::vector<unsigned> bounds; // L+1 byte offsets per word
+
+    /* Decode the characters of the next word type and reserve its ids */
+    void AddChars(const std::string& word) {
+        char_offsets.push_back(bounds.size());
+        const unsigned L = DecodeUtf8(word.data(), word.size(), labels, bounds);
+        labels.push_back(0);
+        offsets.push_back(arena.size());
+        lengths.push_back(L);
+        arena.resize(arena.size() + L * (L + 1) / 2);
+    }
+
+    friend class Checkpoint;
+
+    public:
+    SubstringTable() : offsets(), lengths(), arena() {}
+
+    /* Position of word[i:j] in the triangular array of a word of length L */
+    static unsigned Index(unsigned L, unsigned i, unsigned j) {
+        assert(i < j && j <= L);
+        return i * L - i * (i - 1) / 2 + (j - i - 1);
+    }
+
+    /* Whether word[i:j] of a word of length L is given an id, with
+     * substrings of at most `max_length` characters (0 for all) */
+    static bool Kept(unsigned L, unsigned i, unsigned j, unsigned max_length) {
+        return max_length == 0 || j - i <= max_length || (i == 0 && j == L);
+    }
+
+    /* Add the next word type (valid UTF-8), encoding its substrings of at
+     * most `max_length` characters with `vocabulary` */
+    void Add(const std::string& word, SubstringVocabulary& vocabulary,
+            unsigned max_length=0) {
+        AddChars(word);
+        const unsigned w = offsets.size() - 1, L = lengths[w];
+        const unsigned* b = Bounds(w);
+        int* ids = &arena[offsets[w]];
+        for(unsigned i = 0; i < L; i++)
+            for(unsigned j = i+1; j <= L; j++)
+                *ids++ = Kept(L, i, j, max_length)
+                    ? vocabulary.Encode(word.data() + b[i], b[j] - b[i]) : -1;
+    }
+
+    /* Add all the word types of `words` in parallel: each shard of words is
+     * encoded with its own vocabulary, which are then merged in order into
+     * `vocabulary` (giving the same ids as successive calls to Add) */
+    void Build(const Vocabulary& words, SubstringVocabulary& vocabulary,
+            ThreadPool& pool, unsigned max_length=0) {
+        const unsigned first = offsets.size();
+        for(const std::string& word: words)
+            AddChars(word);
+
+        const unsigned n_shards = 4 * pool.size();
+        const unsigned shard_size = (words.Size() + n_shards - 1) / n_shards;
+        std::vector<SubstringVocabulary> shards(n_shards);
+        pool.enqueue_range(0, n_shards, [&] (size_t s, unsigned thread) {
+            for(unsigned w = s * shard_size; w < std::min<size_t>((s+1) * shard_size, words.Size()); w++) {
+                const std::string& word = words.Convert(w);
+                const unsigned L = lengths[first + w];
+                const unsigned* b = Bounds(first + w);
+                int* ids = &arena[offsets[first + w]];
+                for(unsigned i = 0; i < L; i++)
+                    for(unsigned j = i+1; j <= L; j++)
+                        *ids++ = Kept(L, i, j, max_length)
+                            ? shards[s].Encode(word.data() + b[i], b[j] - b[i]) : -1;
+            }
+        }, 1);
+        pool.wait();
+
+        // Merge shard vocabularies in order, then renumber the shard ids
+        std::vector< std::vector<unsigned> > mappings(n_shards);
+        for(unsigned s = 0; s < n_shards; s++) {
+            mappings[s] = vocabulary.Merge(shards[s]);
+            shards[s] = SubstringVocabulary();
+        }
+        pool.enqueue_range(0, n_shards, [&] (size_t s, unsigned thread) {
+            const unsigned end = std::min<size_t>((s+1) * shard_size, words.Size());
+            if(s * shard_size >= end) return;
+            const size_t stop = (first + end < offsets.size()) ? offsets[first + end] : arena.size();
+            for(size_t k = offsets[first + s * shard_size]; k < stop; k++)
+                if(arena[k] >= 0) arena[k] = mappings[s][arena[k]];
+        }, 1);
+        pool.wait();
+    }
+
+    /* Labels of the characters of word type `w` (utf8.h) */
+    const int* Labels(unsigned w) const {
+        assert(w < char_offsets.size());
+        return &labels[char_offsets[w]];
+    }
+
+    /* Byte offsets of the characters of word type `w`, and of its end */
+    const unsigned* Bounds(unsigned w) const {
+        assert(w < char_offsets.size());
+        return &bounds[char_offsets[w]];
+    }
+
+    /* Length of word type `w`, in characters */
+    unsigned Length(unsigned w) const {
+        assert(w < lengths.size());
+        return lengths[w];
+    }
+
+    /* Triangular array of substring ids of word type `w` */
+    const int* Ids(unsigned w) const {
+        assert(w < offsets.size());
+        return &arena[offsets[w]];
+    }
+
+    /* Id of the substring word[i:j] of word type `w` */
+    int Id(unsigned w, unsigned i, unsigned j) const {
+        return Ids(w)[Index(Length(w), i, j)];
+    }
+
+    size_t Size() const {
+        return offsets.size();
+    }
+};
@@ -0,0 +1,69 @@
+#include <thread>
+#include <cstdlib>
+#include "prob.h"
+
+/* Concurrency test for the sparse counts
+ * Every thread increments random ids and decrements ids it has incremented
+ * itself, so that no count goes below zero, while the table grows from its
+ * initial capacity. The counts and the support are then compared with the
+ * sum of what each thread has done. Exits with status 1 on any mismatch. */
+
+const unsigned K = 1 << 20;
+const unsigned n_updates = 200000; // per thread
+
+bool Run(unsigned n_threads, unsigned seed) {
+    SparseCounts counts;
+    std::vector<std::vector<int>> expected(n_threads, std::vector<int>(K));
+    std::vector<std::thread> threads;
+    for(unsigned t = 0; t < n_threads; t++) {
+        threads.emplace_back([&counts, &expected, seed, t] {
+            std::mt19937 engine(seed + t);
+            std::vector<unsigned> held; // ids incremented and not decremented yet
+            for(unsigned i = 0; i < n_updates; i++) {
+                if(held.empty() || engine() % 2) {
+                    const unsigned k = engine() % K;
+                    counts.Add(k, 1);
+                    expected[t][k]++;
+                    held.push_back(k);
+                }
+                else {
+                    const unsigned j = engine() % held.size();
+                    const unsigned k = held[j];
+                    held[j] = held.back();
+                    held.pop_back();
+                    counts.Add(k, -1);
+                    expected[t][k]--;
+                }
+            }
+        });
+    }
+    for(auto& thread: threads)
+        thread.join();
+    counts.Synchronize();
+
+    unsigned wrong = 0, support = 0, table_support = 0;
+    for(unsigned k = 0; k < K; k++) {
+        int count = 0;
+        for(unsigned t = 0; t < n_threads; t++)
+            count += expected[t][k];
+        support += (count > 0);
+        wrong += (counts.Get(k) != (unsigned) count);
+    }
+    counts.ForEach([&table_support] (unsigned k, unsigned c) { table_support++; });
+    if(wrong > 0 || table_support != support) {
+        std::cerr << n_threads << " threads, seed " << seed << ": " << wrong
+            << " wrong counts, |support|=" << table_support << " instead of " << support << "\n";
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char** argv) {
+    const unsigned n_runs = (argc > 1) ? atoi(argv[1]) : 10;
+    bool ok = true;
+    for(unsigned n_threads: {1, 2, 8, 32})
+        for(unsigned run = 0; run < n_runs; run++)
+            ok &= Run(n_threads, 1000 * run);
+    std::cout << (ok ? "OK" : "FAILED") << "\n";
+    return ok ? 0 : 1;
+}
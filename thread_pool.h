@@ -1,60 +1,211 @@
 #include <mutex>
 #include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <algorithm>
+#include <chrono>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
 
-/* A semaphore, from http://p9as.blogspot.com/2012/06/c11-semaphores.html */
+/* A persistent work-stealing thread pool
+ * Workers are started once and live as long as the pool. Each worker owns a
+ * deque of tasks: it pops from the front of its own deque and, when it runs
+ * dry, steals from the back of the other workers' deques.
+ * Tasks receive the index of the worker running them, which callers use to
+ * keep per-thread state (random engines, scratch buffers...) */
 
-class Semaphore {
-  int value_;
-  int wakeups_;
+class ThreadPool {
+  typedef std::function<void(unsigned)> Task;
+
+  struct Queue {
+      std::mutex mutex;
+      std::deque<Task> tasks;
+  };
+
+  unsigned n_threads;
+  std::vector< std::unique_ptr<Queue> > queues;
+  std::vector<std::thread> workers;
+  std::atomic<size_t> queued; // tasks waiting in the deques
+  size_t pending; // tasks submitted but not finished
+  unsigned next_queue;
+  bool stop;
   std::mutex mutex_;
-  std::condition_variable cond_;
-  
- public:
-  Semaphore(int value) : value_(value), wakeups_(0) {}
-  
-  void wait();
-  void signal();
+  std::condition_variable work_cond, done_cond;
+  std::vector<double> busy; // seconds spent running tasks, per worker
+  std::vector<size_t> ran, stolen; // tasks run and tasks stolen, per worker
 
-};
+  bool pop(unsigned k, Task& task) {
+      // Own deque first, then steal from the others
+      for(unsigned i = 0; i < n_threads; i++) {
+          Queue& queue = *queues[(k + i) % n_threads];
+          std::lock_guard<std::mutex> lock(queue.mutex);
+          if(queue.tasks.empty()) continue;
+          if(i == 0) {
+              task = std::move(queue.tasks.front());
+              queue.tasks.pop_front();
+          }
+          else {
+              task = std::move(queue.tasks.back());
+              queue.tasks.pop_back();
+              stolen[k]++;
+          }
+          queued--;
+          return true;
+      }
+      return false;
+  }
 
-void Semaphore::signal() {
-  std::lock_guard<std::mutex> lock(mutex_);
-  value_++;
-  if (value_ <= 0) {
-      wakeups_++;
-      cond_.notify_one();
-    }
-}
-
-void Semaphore::wait() {
-  std::unique_lock<std::mutex> lock(mutex_);
-  value_--;
-  if (value_ < 0) {
-      cond_.wait(lock, [this] { return this->wakeups_ > 0; });
-      wakeups_--;
-    }
-}
-
-/* A simple "thread pool", which limits the amount of running threads to a fixed number */
+  void run(unsigned k) {
+      Task task;
+      while(true) {
+          if(pop(k, task)) {
+              const auto start = std::chrono::steady_clock::now();
+              task(k);
+              task = nullptr;
+              busy[k] += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+              ran[k]++;
+              std::lock_guard<std::mutex> lock(mutex_);
+              if(--pending == 0)
+                  done_cond.notify_all();
+              continue;
+          }
+          std::unique_lock<std::mutex> lock(mutex_);
+          work_cond.wait(lock, [this] { return stop || queued > 0; });
+          if(stop && queued == 0) return;
+      }
+  }
 
-class ThreadPool {
-  unsigned n_threads;
-  Semaphore semaphore;
+  void push(Task task) {
+      std::unique_lock<std::mutex> lock(mutex_);
+      Queue& queue = *queues[next_queue];
+      next_queue = (next_queue + 1) % n_threads;
+      pending++;
+      {
+          std::lock_guard<std::mutex> queue_lock(queue.mutex);
+          queue.tasks.push_back(std::move(task));
+      }
+      queued++;
+      work_cond.notify_one();
+  }
 
  public:
-  ThreadPool(unsigned n_threads) : semaphore(n_threads), n_threads(n_threads) {}
+  ThreadPool(unsigned n_threads) : n_threads(n_threads > 0 ? n_threads : 1),
+      queued(0), pending(0), next_queue(0), stop(false), busy(this->n_threads, 0),
+      ran(this->n_threads, 0), stolen(this->n_threads, 0) {
+      for(unsigned k = 0; k < this->n_threads; k++)
+          queues.emplace_back(new Queue());
+      for(unsigned k = 0; k < this->n_threads; k++)
+          workers.emplace_back([this, k] { this->run(k); });
+  }
+
+  ~ThreadPool() {
+      {
+          std::lock_guard<std::mutex> lock(mutex_);
+          stop = true;
+      }
+      work_cond.notify_all();
+      for(auto& worker: workers)
+          worker.join();
+  }
+
+  unsigned size() const {
+      return n_threads;
+  }
 
+  /* Submit a single task f(thread) */
   template<typename F>
   void enqueue(F f) {
-    semaphore.wait();
-    std::thread([this, f] {
-        f();
-        this->semaphore.signal();
-    }).detach();
+      push(Task(f));
+  }
+
+  /* Submit f(i, thread) for i in [begin, end) as tasks of `grain` indices
+   * (0 picks a grain giving every worker a few batches to balance) */
+  template<typename F>
+  void enqueue_range(size_t begin, size_t end, F f, size_t grain=0) {
+      if(grain == 0)
+          grain = std::max<size_t>(1, (end - begin) / (16 * n_threads));
+      for(size_t lo = begin; lo < end; lo += grain) {
+          const size_t hi = std::min(end, lo + grain);
+          push(Task([f, lo, hi] (unsigned thread) {
+              for(size_t i = lo; i < hi; i++)
+                  f(i, thread);
+          }));
+      }
+  }
+
+  /* Submit f(order[n], thread) for the chunks [bounds[c], bounds[c+1]) of
+   * `order`, one task each; chunks are dealt to the workers in turn, so each
+   * worker runs its share in the given order (see Schedule in schedule.h) */
+  template<typename F>
+  void enqueue_chunks(const std::vector<unsigned>& order, const std::vector<size_t>& bounds, F f) {
+      const unsigned* items = order.data();
+      for(size_t c = 0; c + 1 < bounds.size(); c++) {
+          const size_t lo = bounds[c], hi = bounds[c+1];
+          push(Task([f, items, lo, hi] (unsigned thread) {
+              for(size_t n = lo; n < hi; n++)
+                  f(items[n], thread);
+          }));
+      }
+  }
+
+  /* Pin worker k to the k-th CPU (modulo their number) the process may run
+   * on, so that each worker keeps its caches and, since buffers are first
+   * touched by the worker using them, its memory node. Returns false if
+   * affinity is not supported or could not be set. */
+  bool pin() {
+#ifdef __linux__
+      cpu_set_t allowed;
+      if(sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+          return false;
+      std::vector<int> cpus;
+      for(int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+          if(CPU_ISSET(cpu, &allowed))
+              cpus.push_back(cpu);
+      if(cpus.empty()) return false;
+      bool ok = true;
+      for(unsigned k = 0; k < n_threads; k++) {
+          cpu_set_t set;
+          CPU_ZERO(&set);
+          CPU_SET(cpus[k % cpus.size()], &set);
+          ok = pthread_setaffinity_np(workers[k].native_handle(), sizeof(set), &set) == 0 && ok;
+      }
+      return ok;
+#else
+      return false;
+#endif
+  }
+
+  /* Time worker k has spent running tasks since the last reset_busy();
+   * only meaningful after wait() */
+  double busy_seconds(unsigned k) const {
+      return busy[k];
+  }
+
+  /* Tasks worker k has run, and how many of them it stole from other
+   * workers, since the last reset_busy() */
+  size_t tasks_run(unsigned k) const {
+      return ran[k];
+  }
+
+  size_t tasks_stolen(unsigned k) const {
+      return stolen[k];
+  }
+
+  void reset_busy() {
+      std::fill(busy.begin(), busy.end(), 0);
+      std::fill(ran.begin(), ran.end(), 0);
+      std::fill(stolen.begin(), stolen.end(), 0);
   }
 
-  void join() {
-    for(unsigned k = 0; k < n_threads; k++)
-        semaphore.wait();
+  /* Barrier: block until every submitted task has finished */
+  void wait() {
+      std::unique_lock<std::mutex> lock(mutex_);
+      done_cond.wait(lock, [this] { return pending == 0; });
   }
 };
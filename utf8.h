@@ -0,0 +1,92 @@
+#include <string>
+#include <vector>
+#include <iostream>
+#include <cstdint>
+#include <cstring>
+
+/* UTF-8 input
+ * Words are segmented over characters (code points), not bytes: each word
+ * type is decoded once into the byte offsets of its characters and their
+ * lattice labels. A character label is its code point + 1, since 0 is the
+ * epsilon label, so all labels are below `max_label` and the morpheme
+ * boundary markers of the lattices can be placed above it. */
+
+const int max_label = 0x110001;
+
+/* Length of the well-formed UTF-8 sequence at the start of `s` (of `n` > 0
+ * bytes), or 0 if it is not well-formed (overlong, surrogate, > U+10FFFF) */
+inline unsigned Utf8Length(const unsigned char* s, size_t n) {
+    const unsigned char c = s[0];
+    if(c < 0x80) return 1;
+    auto cont = [s, n] (unsigned i, unsigned char lo, unsigned char hi) {
+        return i < n && s[i] >= lo && s[i] <= hi;
+    };
+    if(c >= 0xC2 && c <= 0xDF)
+        return cont(1, 0x80, 0xBF) ? 2 : 0;
+    if(c >= 0xE0 && c <= 0xEF) {
+        const unsigned char lo = (c == 0xE0) ? 0xA0 : 0x80;
+        const unsigned char hi = (c == 0xED) ? 0x9F : 0xBF;
+        return (cont(1, lo, hi) && cont(2, 0x80, 0xBF)) ? 3 : 0;
+    }
+    if(c >= 0xF0 && c <= 0xF4) {
+        const unsigned char lo = (c == 0xF0) ? 0x90 : 0x80;
+        const unsigned char hi = (c == 0xF4) ? 0x8F : 0xBF;
+        return (cont(1, lo, hi) && cont(2, 0x80, 0xBF) && cont(3, 0x80, 0xBF)) ? 4 : 0;
+    }
+    return 0;
+}
+
+/* Check that `data` is valid UTF-8, skipping ASCII 8 bytes at a time */
+inline bool ValidUtf8(const char* data, size_t size) {
+    const unsigned char* s = reinterpret_cast<const unsigned char*>(data);
+    size_t i = 0;
+    while(i < size) {
+        uint64_t block;
+        while(i + 8 <= size && (memcpy(&block, s + i, 8), (block & 0x8080808080808080ull) == 0))
+            i += 8;
+        if(i == size) break;
+        const unsigned length = Utf8Length(s + i, size - i);
+        if(length == 0) return false;
+        i += length;
+    }
+    return true;
+}
+
+/* Decode valid UTF-8 `data` into character labels (code point + 1) and
+ * byte bounds: character i is data[bounds[i]:bounds[i+1]]. Both are appended
+ * to; returns the number of characters */
+inline unsigned DecodeUtf8(const char* data, size_t size,
+        std::vector<int>& labels, std::vector<unsigned>& bounds) {
+    const unsigned char* s = reinterpret_cast<const unsigned char*>(data);
+    unsigned n = 0;
+    for(size_t i = 0; i < size; n++) {
+        bounds.push_back(i);
+        const unsigned char c = s[i];
+        int code_point;
+        if(c < 0x80)
+            code_point = s[i++];
+        else if(c < 0xE0) {
+            code_point = ((c & 0x1F) << 6) | (s[i+1] & 0x3F);
+            i += 2;
+        }
+        else if(c < 0xF0) {
+            code_point = ((c & 0x0F) << 12) | ((s[i+1] & 0x3F) << 6) | (s[i+2] & 0x3F);
+            i += 3;
+        }
+        else {
+            code_point = ((c & 0x07) << 18) | ((s[i+1] & 0x3F) << 12)
+                | ((s[i+2] & 0x3F) << 6) | (s[i+3] & 0x3F);
+            i += 4;
+        }
+        labels.push_back(code_point + 1);
+    }
+    bounds.push_back(size);
+    return n;
+}
+
+void CheckUtf8(const std::string& word) {
+    if(!ValidUtf8(word.data(), word.size())) {
+        std::cerr << "Invalid UTF-8 in word `" << word << "`\n";
+        exit(1);
+    }
+}
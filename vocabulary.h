@@ -2,6 +2,8 @@
 #include <vector>
 #include <string>
 #include <cassert>
+#include <cstdint>
+#include <algorithm>
 
 class Vocabulary {
     std::unordered_map<std::string, unsigned> word2id;
@@ -45,3 +47,101 @@ class Vocabulary {
     }
 
 };
+
+/* An interning vocabulary for the (many) substrings of the word types
+ * Each distinct string is stored once in a contiguous character arena and
+ * looked up through an open-addressing hash table of ids, directly from a
+ * character range: encoding a substring never allocates a temporary string */
+
+class SubstringVocabulary {
+    std::vector<char> arena;
+    std::vector<size_t> offsets; // string k is arena[offsets[k]:offsets[k+1]]
+    std::vector<uint32_t> hashes; // hash of each string, kept for rehashing
+    std::vector<uint32_t> table; // open addressing, empty slots hold `empty`
+    static const uint32_t empty = -1;
+
+    friend class Checkpoint;
+
+    static uint32_t Hash(const char* data, size_t length) { // FNV-1a
+        uint32_t h = 2166136261u;
+        for(size_t i = 0; i < length; i++)
+            h = (h ^ (unsigned char) data[i]) * 16777619u;
+        return h;
+    }
+
+    bool Equal(uint32_t k, const char* data, size_t length) const {
+        return offsets[k+1] - offsets[k] == length
+            && std::equal(data, data + length, arena.begin() + offsets[k]);
+    }
+
+    /* Slot holding `data`, or the empty slot where it would go */
+    size_t Slot(const char* data, size_t length, uint32_t hash) const {
+        const size_t mask = table.size() - 1;
+        size_t slot = hash & mask;
+        while(table[slot] != empty && !(hashes[table[slot]] == hash
+                    && Equal(table[slot], data, length)))
+            slot = (slot + 1) & mask;
+        return slot;
+    }
+
+    void Grow() {
+        std::vector<uint32_t> old(table.size() * 2, empty);
+        table.swap(old);
+        const size_t mask = table.size() - 1;
+        for(uint32_t k = 0; k < hashes.size(); k++) {
+            size_t slot = hashes[k] & mask;
+            while(table[slot] != empty)
+                slot = (slot + 1) & mask;
+            table[slot] = k;
+        }
+    }
+
+    public:
+    SubstringVocabulary() : arena(), offsets(1, 0), hashes(), table(1024, empty) {}
+
+    // Convert string to id (creating a new id if necessary)
+    unsigned Encode(const char* data, size_t length) {
+        const uint32_t hash = Hash(data, length);
+        size_t slot = Slot(data, length, hash);
+        if(table[slot] != empty)
+            return table[slot];
+        const uint32_t k = hashes.size();
+        arena.insert(arena.end(), data, data + length);
+        offsets.push_back(arena.size());
+        hashes.push_back(hash);
+        table[slot] = k;
+        if(2 * hashes.size() > table.size())
+            Grow();
+        return k;
+    }
+
+    unsigned Encode(const std::string& word) {
+        return Encode(word.data(), word.size());
+    }
+
+    // Convert string to existing id (-1 if absent)
+    int Find(const char* data, size_t length) const {
+        const uint32_t k = table[Slot(data, length, Hash(data, length))];
+        return (k == empty) ? -1 : (int) k;
+    }
+
+    // Convert id to string
+    std::string Convert(unsigned k) const {
+        assert(k < Size());
+        return std::string(arena.begin() + offsets[k], arena.begin() + offsets[k+1]);
+    }
+
+    /* Add all the strings of `other` to this vocabulary
+     * and return the id of each of them in this vocabulary */
+    std::vector<unsigned> Merge(const SubstringVocabulary& other) {
+        std::vector<unsigned> ids(other.Size());
+        for(unsigned k = 0; k < other.Size(); k++)
+            ids[k] = Encode(other.arena.data() + other.offsets[k],
+                    other.offsets[k+1] - other.offsets[k]);
+        return ids;
+    }
+
+    size_t Size() const {
+        return hashes.size();
+    }
+};